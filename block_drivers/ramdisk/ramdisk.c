@@ -4,44 +4,1670 @@
 #include <linux/fs.h>
 #include <linux/init.h>			/* Needed for macros	*/
 #include <linux/blkdev.h>
-#include <linux/vmalloc.h>
+#include <linux/blk-mq.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/crypto.h>
+#include <linux/ktime.h>
+#include <linux/device.h>
+#include <linux/mm.h>
+#include <linux/bitops.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/page_ref.h>
+#include <linux/refcount.h>
+#include <linux/idr.h>
+#include <linux/capability.h>
+#include <linux/nodemask.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "ramdisk.h"
+
+/*
+ *	A page of a compressed disk. Entries are never modified once stored,
+ *	a write replaces the whole entry.
+ */
+struct ramdisk_zpage {
+	struct rcu_head rcu;
+	refcount_t ref;		/*	disks sharing the entry	*/
+	struct page *raw;	/*	incompressible data kept as is, else NULL	*/
+	unsigned int len;	/*	bytes stored: compressed size or PAGE_SIZE	*/
+	u8 data[];
+};
+
+/*
+ *	kmalloc rounds anything over half a page up to a full page, so a page
+ *	that compresses worse than this is cheaper to keep raw.
+ */
+#define ZPAGE_MAX_LEN	(PAGE_SIZE / 2 - sizeof(struct ramdisk_zpage))
+
+/*	Per CPU compression context, only used with preemption disabled	*/
+struct ramdisk_zstrm {
+	struct crypto_comp *tfm;
+	u8 *buffer;	/*	2 pages: compressed output can exceed a page	*/
+	u64 comp_ns;	/*	time spent compressing on this CPU	*/
+	u64 decomp_ns;	/*	time spent decompressing on this CPU	*/
+};
+
+/*	I/O classes counted apart; WRITE_ZEROES goes with discard	*/
+enum {
+	RAMDISK_STAT_READ,
+	RAMDISK_STAT_WRITE,
+	RAMDISK_STAT_DISCARD,
+	RAMDISK_STAT_FLUSH,
+	RAMDISK_STAT_NR,
+};
+
+/*	Service time buckets: bucket n counts times in [2^n, 2^(n+1)) ns	*/
+#define RAMDISK_LAT_BUCKETS	32
+
+/*	Per CPU event counters, summed when read	*/
+struct ramdisk_pcpu {
+	u64 ops[RAMDISK_STAT_NR];
+	u64 bytes[RAMDISK_STAT_NR];
+	u64 merges[RAMDISK_STAT_NR];	/*	bios merged into a request (blk-mq only)	*/
+	u64 lat[RAMDISK_STAT_NR][RAMDISK_LAT_BUCKETS];
+	u64 same_checks;	/*	whole page writes checked for a fill	*/
+	u64 same_hits;		/*	of which stored as a fill	*/
+	u64 cow_faults;		/*	shared pages copied on write	*/
+};
+
+/*	Requests parked on a poll queue until blk_poll comes for them	*/
+struct ramdisk_poll_queue {
+	spinlock_t lock;
+	struct list_head list;
+};
 
 struct ramdisk_dev {
-	int size;	/*	size in sectors to form the disk	*/
-	u8 *data;
+	int id;		/*	N of ramdiskN, also its minor	*/
+	struct list_head list;	/*	in ramdisk_list	*/
+	u64 size;	/*	size of the disk in bytes	*/
+	int node;	/*	node backing pages come from, or NUMA_NO_NODE / RAMDISK_NODE_INTERLEAVE	*/
+	struct xarray pages;	/*	backing store entries, by page index	*/
+	bool compress;	/*	entries are struct ramdisk_zpage	*/
+	struct ramdisk_zstrm __percpu *zstrm;
+	atomic64_t zpages;	/*	pages in the compressed store	*/
+	atomic64_t zraw_pages;	/*	of which stored raw	*/
+	atomic64_t zsize;	/*	bytes they take	*/
+	bool same_fill;	/*	store one word for same filled pages	*/
+	atomic64_t same_pages;	/*	pages stored that way	*/
+	struct ramdisk_pcpu __percpu *pcpu;
+	struct block_device *backing;	/*	device cached with backing_dev, else NULL	*/
+	pgoff_t nr_pages;	/*	pages of it the disk exposes	*/
+	unsigned long *dirty;	/*	bitmap: pages newer than on the backing device	*/
+	atomic_long_t nr_dirty;	/*	bits set in it	*/
+	unsigned long dirty_thresh_pages;	/*	wake the flusher at this many	*/
+	unsigned int flush_interval_ms;	/*	and at least this often	*/
+	struct mutex wb_lock;	/*	serializes writeback and discard	*/
+	struct page **wb_pages;	/*	WB_BATCH_PAGES bounce pages for writeback	*/
+	wait_queue_head_t flush_wait;
+	struct task_struct *flusher;
+	struct workqueue_struct *cache_wq;	/*	runs backing I/O for the submission path	*/
+	atomic64_t cache_fetched;	/*	pages read from the backing device	*/
+	atomic64_t cache_flushed;	/*	pages written back to it	*/
 	short users; /* How many users */
+	bool dying;	/*	being deleted: no more opens	*/
 	short media_change; /* Flag a media change? */
 	spinlock_t lock; /* For mutual exclusion */
 	struct request_queue *queue; /* The device request queue */
+	struct blk_mq_tag_set tag_set; /* Hardware queues in blk-mq mode */
+	struct ramdisk_poll_queue *pq; /* One per hardware queue */
 	struct gendisk *gd; /* The gendisk structure */
+	struct dentry *debugfs; /* debugfs/ramdisk/ramdiskN */
+};
+
+/*	Geometry and placement of a disk, from the module parameters or its parent	*/
+struct ramdisk_config {
+	sector_t nsectors;
+	unsigned int logical_block_size;
+	unsigned int physical_block_size;
+	unsigned int max_io_sectors;
+	int node;
+	bool cache;	/*	in front of backing_dev, which sets the size	*/
+};
+
+static int ramdisk_major = 0;
+
+/*	Every disk: nr_disks from the module parameters, then snapshots	*/
+static LIST_HEAD(ramdisk_list);
+static DEFINE_MUTEX(ramdisk_list_lock);
+static DEFINE_IDA(ramdisk_ida);
+
+/*
+ *	Two ways to feed the disk, so they can be benchmarked against each other:
+ *	-	bio based: ramdisk_req_fn gets every bio via blk_queue_make_request
+ *	-	blk-mq: one hardware queue per CPU, requests come to ramdisk_queue_rq
+ *	Neither path takes dev->lock.
+ */
+enum {
+	RAMDISK_Q_BIO	= 0,
+	RAMDISK_Q_MQ	= 1,
+};
+
+static int queue_mode = RAMDISK_Q_BIO;
+module_param(queue_mode, int, 0444);
+MODULE_PARM_DESC(queue_mode, "I/O path: 0 = bio based, 1 = blk-mq (default: 0)");
+
+/*
+ *	Extra hardware queues for polled (REQ_HIPRI) I/O in blk-mq mode.
+ *	Requests on them are completed by blk_poll instead of inline.
+ */
+static unsigned int poll_queues = 1;
+module_param(poll_queues, uint, 0444);
+MODULE_PARM_DESC(poll_queues, "Poll queues for io_uring IOPOLL / RWF_HIPRI in blk-mq mode (default: 1)");
+
+static unsigned int hw_queue_depth = 128;
+module_param(hw_queue_depth, uint, 0444);
+MODULE_PARM_DESC(hw_queue_depth, "Tags per blk-mq hardware queue (default: 128)");
+
+/*
+ *	Disks created at load: ramdisk0 .. ramdisk<nr_disks - 1>. The geometry
+ *	parameters below take one value per disk; disks past the last value
+ *	given take that last value.
+ */
+#define RAMDISK_MAX_DISKS	32
+
+static unsigned int nr_disks = 1;
+module_param(nr_disks, uint, 0444);
+MODULE_PARM_DESC(nr_disks, "Number of disks to create (default: 1, max: 32)");
+
+/*
+ *	Only pages that get written are ever allocated, so a big disk costs
+ *	nothing until it is used.
+ */
+static unsigned long disk_size_mb[RAMDISK_MAX_DISKS] = { 16 };
+static int nr_disk_size_mb;
+module_param_array(disk_size_mb, ulong, &nr_disk_size_mb, 0444);
+MODULE_PARM_DESC(disk_size_mb, "Size of each disk in MiB (default: 16)");
+
+/*	0 picks 512 bytes, or PAGE_SIZE on a compressed disk	*/
+static unsigned int logical_block_size[RAMDISK_MAX_DISKS];
+static int nr_logical_block_size;
+module_param_array(logical_block_size, uint, &nr_logical_block_size, 0444);
+MODULE_PARM_DESC(logical_block_size, "Logical block size of each disk, 512 to PAGE_SIZE (default: 0 = 512)");
+
+static unsigned int physical_block_size[RAMDISK_MAX_DISKS];
+static int nr_physical_block_size;
+module_param_array(physical_block_size, uint, &nr_physical_block_size, 0444);
+MODULE_PARM_DESC(physical_block_size, "Physical block size of each disk (default: 0 = logical block size)");
+
+static unsigned int max_io_kb[RAMDISK_MAX_DISKS] = { 1024 };
+static int nr_max_io_kb;
+module_param_array(max_io_kb, uint, &nr_max_io_kb, 0444);
+MODULE_PARM_DESC(max_io_kb, "Largest I/O each disk takes in one piece, in KiB (default: 1024)");
+
+/*
+ *	Where backing pages of each disk come from. The default takes them from
+ *	the node of the CPU doing the write, like any other allocation;
+ *	interleaving spreads the pages of the disk over all nodes with memory,
+ *	by page index.
+ */
+#define RAMDISK_NODE_INTERLEAVE	(-2)
+
+static int numa_node[RAMDISK_MAX_DISKS] = { NUMA_NO_NODE };
+static int nr_numa_node;
+module_param_array(numa_node, int, &nr_numa_node, 0444);
+MODULE_PARM_DESC(numa_node, "NUMA node of each disk's pages: -1 = writer's node, -2 = interleave (default: -1)");
+
+/*	Value of a per disk parameter for disk i	*/
+#define ramdisk_param(name, i)	\
+	((i) < nr_##name ? name[i] : name[max(nr_##name, 1) - 1])
+
+/*	Nodes with memory, for RAMDISK_NODE_INTERLEAVE	*/
+static int ramdisk_nodes[MAX_NUMNODES];
+static unsigned int ramdisk_nr_nodes;
+
+/*
+ *	Compressed disks use PAGE_SIZE logical blocks, so every I/O covers whole
+ *	pages and never has to merge with the old contents.
+ */
+static bool compress;
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "Keep pages compressed (default: 0)");
+
+static char *comp_alg = "lz4";
+module_param(comp_alg, charp, 0444);
+MODULE_PARM_DESC(comp_alg, "Crypto compression algorithm used with compress=1 (default: lz4)");
+
+static bool same_fill = true;
+module_param(same_fill, bool, 0444);
+MODULE_PARM_DESC(same_fill, "Keep pages filled with one word as just that word (default: 1)");
+
+/*
+ *	rw_page lets the page cache and swap read and write single pages
+ *	without a bio. Turn it off to compare against the bio path.
+ */
+static bool rw_page = true;
+module_param(rw_page, bool, 0444);
+MODULE_PARM_DESC(rw_page, "Serve single page cache and swap I/O through rw_page (default: 1)");
+
+/*
+ *	Cache mode: ramdisk0 becomes a volatile write-back cache of backing_dev
+ *	and takes its size; its disk_size_mb is ignored. Clean pages stay cached, so
+ *	the store can grow to the size of the backing device.
+ */
+static char *backing_dev;
+module_param(backing_dev, charp, 0444);
+MODULE_PARM_DESC(backing_dev, "Block device to cache in write-back mode (default: none)");
+
+static unsigned long cache_dirty_thresh_mb = 64;
+module_param(cache_dirty_thresh_mb, ulong, 0444);
+MODULE_PARM_DESC(cache_dirty_thresh_mb, "Dirty MiB that start writeback with backing_dev (default: 64)");
+
+static unsigned int cache_flush_interval_ms = 1000;
+module_param(cache_flush_interval_ms, uint, 0444);
+MODULE_PARM_DESC(cache_flush_interval_ms, "Periodic writeback interval with backing_dev, 0 = none (default: 1000)");
+
+#define SECT_SIZE	512
+#define KERNEL_SECTOR_SHIFT 9
+#define KERNEL_SECTOR_SIZE (1 << KERNEL_SECTOR_SHIFT)
+#define PAGE_SECTORS_SHIFT	(PAGE_SHIFT - KERNEL_SECTOR_SHIFT)
+#define PAGE_SECTORS		(1 << PAGE_SECTORS_SHIFT)
+/*	Most pages written back in one bio	*/
+#define WB_BATCH_PAGES	BIO_MAX_PAGES
+
+/*======================================================================================================
+ *					BACKING STORE
+ *					-	one entry per PAGE_SIZE of disk in dev->pages
+ *					-	an entry is allocated on the first write to its page
+ *					-	reads of never written pages return zeroes
+ *					-	entries are a struct page, or a struct ramdisk_zpage
+ *						on a compressed disk, or a value entry holding
+ *						the word a same filled page repeats
+ *					-	snapshots share pages and zpages with their parent;
+ *						a shared page carries RAMDISK_SHARED and is copied
+ *						before it is written (zpages are never written)
+ *======================================================================================================
+ */
+
+/*
+ *	Set on raw page entries that another disk may see too. The page
+ *	refcount counts the disks holding it.
+ */
+#define RAMDISK_SHARED	XA_MARK_0
+
+/*
+ *	Entries can be freed by a discard or an overwrite while an I/O still
+ *	looks at them: lookups run under rcu_read_lock and removed entries are
+ *	freed after a grace period.
+ */
+static void *ramdisk_lookup(struct ramdisk_dev *dev, pgoff_t idx)
+{
+	return xa_load(&dev->pages, idx);
+}
+
+/*
+ *	Write the word a fill entry stands for over len bytes of buf.
+ *	Offsets in a page are sector multiples, so the pattern stays aligned.
+ */
+static void ramdisk_fill(u8 *buf, unsigned long word, unsigned int len)
+{
+	if (0 == word)
+		memset(buf, 0, len);
+	else
+		memset_l((unsigned long *)buf, word, len / sizeof(word));
+}
+
+/*
+ *	Node to allocate the backing of page idx on.
+ */
+static int ramdisk_page_node(struct ramdisk_dev *dev, pgoff_t idx)
+{
+	if (RAMDISK_NODE_INTERLEAVE == dev->node)
+		return ramdisk_nodes[idx % ramdisk_nr_nodes];
+	return dev->node;
+}
+
+static struct page *ramdisk_alloc_page(struct ramdisk_dev *dev, pgoff_t idx,
+				       gfp_t gfp)
+{
+	return alloc_pages_node(ramdisk_page_node(dev, idx), gfp, 0);
+}
+
+static void ramdisk_free_page_rcu(struct rcu_head *head)
+{
+	struct page *page = container_of(head, struct page, rcu_head);
+
+	page_ref_unfreeze(page, 1);
+	__free_page(page);
+}
+
+/*
+ *	Drop one disk's hold on a page. Only the last holder frees it, after a
+ *	grace period: freezing the count at 1 keeps two disks dropping the page
+ *	at once from both missing that.
+ */
+static void ramdisk_put_page(struct page *page)
+{
+	for (;;) {
+		if (page_ref_freeze(page, 1)) {
+			call_rcu(&page->rcu_head, ramdisk_free_page_rcu);
+			return;
+		}
+		if (page_ref_add_unless(page, -1, 1))
+			return;
+	}
+}
+
+static void ramdisk_free_zpage_rcu(struct rcu_head *head)
+{
+	struct ramdisk_zpage *zp = container_of(head, struct ramdisk_zpage, rcu);
+
+	if (zp->raw)
+		__free_page(zp->raw);
+	kfree(zp);
+}
+
+/*
+ *	Drop an entry that is no longer reachable from dev->pages.
+ */
+static void ramdisk_free_entry(struct ramdisk_dev *dev, void *entry)
+{
+	struct ramdisk_zpage *zp = entry;
+
+	if (xa_is_value(entry)) {
+		atomic64_dec(&dev->same_pages);
+		return;
+	}
+	if (!dev->compress) {
+		ramdisk_put_page(entry);
+		return;
+	}
+	atomic64_dec(&dev->zpages);
+	atomic64_sub(zp->len, &dev->zsize);
+	if (zp->raw)
+		atomic64_dec(&dev->zraw_pages);
+	if (refcount_dec_and_test(&zp->ref))
+		call_rcu(&zp->rcu, ramdisk_free_zpage_rcu);
+}
+
+/*
+ *	Take a hold on an entry for another disk, which accounts for it as if
+ *	it had stored it itself.
+ */
+static void ramdisk_get_entry(struct ramdisk_dev *dev, void *entry)
+{
+	struct ramdisk_zpage *zp = entry;
+
+	if (xa_is_value(entry)) {
+		atomic64_inc(&dev->same_pages);
+		return;
+	}
+	if (!dev->compress) {
+		page_ref_inc(entry);
+		return;
+	}
+	refcount_inc(&zp->ref);
+	atomic64_inc(&dev->zpages);
+	atomic64_add(zp->len, &dev->zsize);
+	if (zp->raw)
+		atomic64_inc(&dev->zraw_pages);
+}
+
+/*	Disks holding the entry, a value entry counts as one	*/
+static unsigned int ramdisk_entry_refs(struct ramdisk_dev *dev, void *entry)
+{
+	if (xa_is_value(entry))
+		return 1;
+	if (!dev->compress)
+		return page_ref_count(entry);
+	return refcount_read(&((struct ramdisk_zpage *)entry)->ref);
+}
+
+static void ramdisk_free_pages(struct ramdisk_dev *dev)
+{
+	unsigned long idx;
+	void *entry;
+
+	xa_for_each(&dev->pages, idx, entry) {
+		ramdisk_free_entry(dev, entry);
+		cond_resched();
+	}
+	xa_destroy(&dev->pages);
+}
+
+/*
+ *	Put entry at idx if cur is still there, and drop the shared mark in
+ *	the same step: a writer that saw the new entry still marked shared
+ *	would copy it and free it under the writer about to fill it. entry
+ *	NULL only drops the mark. Returns what was at idx, or an xa_err().
+ */
+static void *ramdisk_own_entry(struct ramdisk_dev *dev, pgoff_t idx,
+			       void *cur, void *entry)
+{
+	XA_STATE(xas, &dev->pages, idx);
+	void *prev;
+
+	do {
+		xas_lock(&xas);
+		prev = xas_load(&xas);
+		if (prev == cur) {
+			if (entry)
+				xas_store(&xas, entry);
+			/*	Marks stay with the index, not the entry	*/
+			xas_clear_mark(&xas, RAMDISK_SHARED);
+		}
+		xas_unlock(&xas);
+	} while (xas_nomem(&xas, GFP_NOIO));
+
+	return xas_error(&xas) ? XA_ERROR(xas_error(&xas)) : prev;
+}
+
+/*
+ *	Make sure page idx has a backing page of its own, allocating it on the
+ *	first write or copying it if it is shared with another disk. Writers
+ *	racing for the same index agree on one page via ramdisk_own_entry.
+ *	May sleep.
+ */
+static int ramdisk_insert_page(struct ramdisk_dev *dev, pgoff_t idx)
+{
+	struct page *page;
+	void *cur, *prev;
+	bool shared, sole;
+	u8 *mem, *src;
+
+	for (;;) {
+		/*	RCU: a racing writer of ours may free cur meanwhile	*/
+		rcu_read_lock();
+		cur = xa_load(&dev->pages, idx);
+		shared = cur && !xa_is_value(cur);
+		sole = shared && 1 == page_ref_count(cur);
+		rcu_read_unlock();
+		if (shared) {
+			if (!xa_get_mark(&dev->pages, idx, RAMDISK_SHARED))
+				return 0;
+			/*	The other disks copied it and let go: it is ours alone	*/
+			if (sole && cur == ramdisk_own_entry(dev, idx, cur, NULL))
+				return 0;
+		}
+
+		page = ramdisk_alloc_page(dev, idx, GFP_NOIO | __GFP_HIGHMEM);
+		if (NULL == page)
+			return -ENOMEM;
+		rcu_read_lock();
+		cur = xa_load(&dev->pages, idx);
+		shared = cur && !xa_is_value(cur);
+		if (shared && !xa_get_mark(&dev->pages, idx, RAMDISK_SHARED)) {
+			/*	Somebody else already made it ours	*/
+			rcu_read_unlock();
+			__free_page(page);
+			return 0;
+		}
+		/*
+		 *	A new page is zeroed, so a partial first write leaves the rest
+		 *	reading 0. A fill entry is expanded back into its word, a
+		 *	shared page is copied.
+		 */
+		mem = kmap_atomic(page);
+		if (NULL == cur) {
+			memset(mem, 0, PAGE_SIZE);
+		} else if (!shared) {
+			ramdisk_fill(mem, xa_to_value(cur), PAGE_SIZE);
+		} else {
+			src = kmap_atomic(cur);
+			memcpy(mem, src, PAGE_SIZE);
+			kunmap_atomic(src);
+		}
+		kunmap_atomic(mem);
+		rcu_read_unlock();
+
+		prev = ramdisk_own_entry(dev, idx, cur, page);
+		if (prev == cur) {
+			if (cur)
+				ramdisk_free_entry(dev, cur);
+			if (shared)
+				this_cpu_inc(dev->pcpu->cow_faults);
+			return 0;
+		}
+		/*	Somebody else changed the entry first: start over	*/
+		__free_page(page);
+		if (xa_is_err(prev))
+			return xa_err(prev);
+	}
+}
+
+/*======================================================================================================
+ *					COMPRESSION
+ *					-	compress=1 keeps every page compressed with comp_alg
+ *					-	pages that do not shrink enough are kept raw
+ *					-	one crypto tfm and buffer per CPU, used with preemption off
+ *======================================================================================================
+ */
+
+/*
+ *	Turn one page of data into a new store entry. May sleep.
+ */
+static struct ramdisk_zpage *ramdisk_compress(struct ramdisk_dev *dev,
+					      pgoff_t idx, const u8 *src)
+{
+	int node = ramdisk_page_node(dev, idx);
+	struct ramdisk_zpage *zp = NULL;
+	struct ramdisk_zstrm *strm;
+	unsigned int dlen = 2 * PAGE_SIZE;
+	u64 start;
+	u8 *mem;
+	int ret;
+
+	strm = get_cpu_ptr(dev->zstrm);
+	start = ktime_get_ns();
+	ret = crypto_comp_compress(strm->tfm, src, PAGE_SIZE, strm->buffer, &dlen);
+	strm->comp_ns += ktime_get_ns() - start;
+	if (0 == ret && dlen <= ZPAGE_MAX_LEN) {
+		/*	Preemption is off: no sleeping here, store raw if this fails	*/
+		zp = kmalloc_node(sizeof(*zp) + dlen, GFP_NOWAIT | __GFP_NOWARN, node);
+		if (zp) {
+			refcount_set(&zp->ref, 1);
+			zp->raw = NULL;
+			zp->len = dlen;
+			memcpy(zp->data, strm->buffer, dlen);
+		}
+	}
+	put_cpu_ptr(dev->zstrm);
+	if (zp)
+		goto out;
+
+	zp = kmalloc_node(sizeof(*zp), GFP_NOIO, node);
+	if (NULL == zp)
+		return NULL;
+	zp->raw = alloc_pages_node(node, GFP_NOIO | __GFP_HIGHMEM, 0);
+	if (NULL == zp->raw) {
+		kfree(zp);
+		return NULL;
+	}
+	refcount_set(&zp->ref, 1);
+	zp->len = PAGE_SIZE;
+	mem = kmap_atomic(zp->raw);
+	memcpy(mem, src, PAGE_SIZE);
+	kunmap_atomic(mem);
+	atomic64_inc(&dev->zraw_pages);
+out:
+	atomic64_inc(&dev->zpages);
+	atomic64_add(zp->len, &dev->zsize);
+	return zp;
+}
+
+/*
+ *	Copy len bytes at off of a compressed entry to buf. Never sleeps.
+ */
+static void ramdisk_zread(struct ramdisk_dev *dev, struct ramdisk_zpage *zp,
+			  unsigned int off, u8 *buf, unsigned int len)
+{
+	struct ramdisk_zstrm *strm;
+	unsigned int dlen = PAGE_SIZE;
+	u64 start;
+	u8 *mem;
+	int ret;
+
+	if (zp->raw) {
+		mem = kmap_atomic(zp->raw);
+		memcpy(buf, mem + off, len);
+		kunmap_atomic(mem);
+		return;
+	}
+
+	strm = get_cpu_ptr(dev->zstrm);
+	start = ktime_get_ns();
+	/*	A whole page decompresses straight into the caller's buffer	*/
+	if (PAGE_SIZE == len) {
+		ret = crypto_comp_decompress(strm->tfm, zp->data, zp->len, buf, &dlen);
+	} else {
+		ret = crypto_comp_decompress(strm->tfm, zp->data, zp->len,
+					     strm->buffer, &dlen);
+		memcpy(buf, strm->buffer + off, len);
+	}
+	strm->decomp_ns += ktime_get_ns() - start;
+	put_cpu_ptr(dev->zstrm);
+	WARN_ON_ONCE(ret || PAGE_SIZE != dlen);
+}
+
+static void ramdisk_zexit(struct ramdisk_dev *dev)
+{
+	struct ramdisk_zstrm *strm;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		strm = per_cpu_ptr(dev->zstrm, cpu);
+		if (!IS_ERR_OR_NULL(strm->tfm))
+			crypto_free_comp(strm->tfm);
+		kfree(strm->buffer);
+	}
+	free_percpu(dev->zstrm);
+}
+
+static int ramdisk_zinit(struct ramdisk_dev *dev)
+{
+	struct ramdisk_zstrm *strm;
+	int cpu;
+
+	dev->zstrm = alloc_percpu(struct ramdisk_zstrm);
+	if (NULL == dev->zstrm)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		strm = per_cpu_ptr(dev->zstrm, cpu);
+		strm->tfm = crypto_alloc_comp(comp_alg, 0, 0);
+		if (IS_ERR(strm->tfm)) {
+			int status = PTR_ERR(strm->tfm);
+
+			ramdisk_zexit(dev);
+			return status;
+		}
+		strm->buffer = kmalloc_node(2 * PAGE_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+		if (NULL == strm->buffer) {
+			ramdisk_zexit(dev);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/*======================================================================================================
+ *					SAME FILLED PAGES
+ *					-	same_fill=1 spots whole page writes that repeat one word
+ *					-	the word is kept as a value entry: no page, nothing to compress
+ *					-	reads of such pages are served with a fill
+ *======================================================================================================
+ */
+
+/*
+ *	True if the page repeats one word that fits a value entry. A value
+ *	entry keeps BITS_PER_LONG - 1 bits, so words with the top bit set are
+ *	stored the normal way.
+ */
+static bool ramdisk_page_same_filled(const u8 *src, unsigned long *word)
+{
+	const unsigned long *p = (const unsigned long *)src;
+	unsigned int i, n = PAGE_SIZE / sizeof(*p);
+
+	/*	Most pages differ at the far end already	*/
+	if (p[0] != p[n - 1])
+		return false;
+	for (i = 1; i < n - 1; i++) {
+		if (p[i] != p[0])
+			return false;
+	}
+	*word = p[0];
+	return p[0] <= LONG_MAX;
+}
+
+/*
+ *	Called for every whole page write. Returns true when the page went in
+ *	as a fill entry, with the result of the store in *status. May sleep.
+ */
+static bool ramdisk_try_fill(struct ramdisk_dev *dev, pgoff_t idx,
+			     const u8 *src, int *status)
+{
+	unsigned long word;
+	void *old;
+
+	if (!dev->same_fill)
+		return false;
+	this_cpu_inc(dev->pcpu->same_checks);
+	if (!ramdisk_page_same_filled(src, &word))
+		return false;
+
+	old = xa_store(&dev->pages, idx, xa_mk_value(word), GFP_NOIO);
+	if (xa_is_err(old)) {
+		*status = xa_err(old);
+		return true;
+	}
+	atomic64_inc(&dev->same_pages);
+	this_cpu_inc(dev->pcpu->same_hits);
+	if (old)
+		ramdisk_free_entry(dev, old);
+	*status = 0;
+	return true;
+}
+
+/*======================================================================================================
+ *					PAGE ACCESS
+ *					-	read, write and drop pages of the store, whatever form
+ *						their entries take
+ *======================================================================================================
+ */
+
+/*
+ *	Copy len bytes at off of page idx to buf. Caller holds rcu_read_lock.
+ */
+static void ramdisk_read_chunk(struct ramdisk_dev *dev, pgoff_t idx,
+			       unsigned int off, u8 *buf, unsigned int len)
+{
+	void *entry = ramdisk_lookup(dev, idx);
+	u8 *mem;
+
+	if (NULL == entry) {
+		memset(buf, 0, len);
+	} else if (xa_is_value(entry)) {
+		ramdisk_fill(buf, xa_to_value(entry), len);
+	} else if (dev->compress) {
+		ramdisk_zread(dev, entry, off, buf, len);
+	} else {
+		mem = kmap_atomic(entry);
+		memcpy(buf, mem + off, len);
+		kunmap_atomic(mem);
+	}
+}
+
+/*
+ *	Store a whole page at idx only if idx holds nothing yet: whatever got
+ *	there first (a write, say) is newer than src. May sleep.
+ */
+static int ramdisk_insert_entry(struct ramdisk_dev *dev, pgoff_t idx,
+				const u8 *src)
+{
+	unsigned long word;
+	struct page *page;
+	void *entry, *cur;
+	u8 *mem;
+
+	if (dev->same_fill && ramdisk_page_same_filled(src, &word)) {
+		entry = xa_mk_value(word);
+		atomic64_inc(&dev->same_pages);
+	} else if (dev->compress) {
+		entry = ramdisk_compress(dev, idx, src);
+		if (NULL == entry)
+			return -ENOMEM;
+	} else {
+		page = ramdisk_alloc_page(dev, idx, GFP_NOIO | __GFP_HIGHMEM);
+		if (NULL == page)
+			return -ENOMEM;
+		mem = kmap_atomic(page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(mem);
+		entry = page;
+	}
+
+	cur = xa_cmpxchg(&dev->pages, idx, NULL, entry, GFP_NOIO);
+	if (cur) {
+		ramdisk_free_entry(dev, entry);
+		return xa_is_err(cur) ? xa_err(cur) : 0;
+	}
+	return 0;
+}
+
+/*
+ *	Drop the entries of pages [first, last). Only entries that are present
+ *	are visited, so the cost follows the allocated pages, not the range.
+ */
+static void ramdisk_erase_range(struct ramdisk_dev *dev, pgoff_t first,
+				pgoff_t last)
+{
+	unsigned long idx = first;
+	void *entry;
+
+	if (last <= first)
+		return;
+	entry = xa_find(&dev->pages, &idx, last - 1, XA_PRESENT);
+	while (entry) {
+		xa_erase(&dev->pages, idx);
+		ramdisk_free_entry(dev, entry);
+		cond_resched();
+		entry = xa_find_after(&dev->pages, &idx, last - 1, XA_PRESENT);
+	}
+}
+
+/*
+ *	Compressed entries are never changed in place: a write builds a new
+ *	entry and swaps it in. Less than a page is merged with the old data in
+ *	a bounce page; with PAGE_SIZE logical blocks only partial discards do so.
+ */
+static int ramdisk_zwrite(struct ramdisk_dev *dev, pgoff_t idx,
+			  unsigned int off, const u8 *buf, unsigned int len)
+{
+	struct ramdisk_zpage *zp;
+	struct page *bounce = NULL;
+	const u8 *src = buf;
+	void *old;
+	int status;
+
+	if (PAGE_SIZE != len) {
+		bounce = alloc_page(GFP_NOIO);
+		if (NULL == bounce)
+			return -ENOMEM;
+		rcu_read_lock();
+		ramdisk_read_chunk(dev, idx, 0, page_address(bounce), PAGE_SIZE);
+		rcu_read_unlock();
+		memcpy(page_address(bounce) + off, buf, len);
+		src = page_address(bounce);
+	}
+
+	if (ramdisk_try_fill(dev, idx, src, &status)) {
+		if (bounce)
+			__free_page(bounce);
+		return status;
+	}
+	zp = ramdisk_compress(dev, idx, src);
+	if (bounce)
+		__free_page(bounce);
+	if (NULL == zp)
+		return -ENOMEM;
+
+	old = xa_store(&dev->pages, idx, zp, GFP_NOIO);
+	if (xa_is_err(old)) {
+		ramdisk_free_entry(dev, zp);
+		return xa_err(old);
+	}
+	if (old)
+		ramdisk_free_entry(dev, old);
+	return 0;
+}
+
+/*
+ *	Copy len bytes from buf to off of page idx. May sleep.
+ */
+static int ramdisk_store_chunk(struct ramdisk_dev *dev, pgoff_t idx,
+			       unsigned int off, const u8 *buf, unsigned int len)
+{
+	struct page *page;
+	u8 *mem;
+	int status;
+
+	if (dev->compress)
+		return ramdisk_zwrite(dev, idx, off, buf, len);
+	if (PAGE_SIZE == len && ramdisk_try_fill(dev, idx, buf, &status))
+		return status;
+
+	status = ramdisk_insert_page(dev, idx);
+	if (status)
+		return status;
+	rcu_read_lock();
+	page = ramdisk_lookup(dev, idx);
+	/*
+	 *	No page only if a racing discard or whole page write won: both
+	 *	cover this chunk, so they are simply ordered after us.
+	 */
+	if (page && !xa_is_value(page)) {
+		mem = kmap_atomic(page);
+		memcpy(mem + off, buf, len);
+		kunmap_atomic(mem);
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+/*======================================================================================================
+ *					WRITE-BACK CACHE
+ *					-	backing_dev=<path> puts the store in front of a block device
+ *					-	writes only land in the store and set the page's bit in dev->dirty
+ *					-	a flusher thread writes dirty runs back as large sequential bios,
+ *						every cache_flush_interval_ms or once cache_dirty_thresh_mb pile up
+ *					-	reads of pages not in the store fetch them from the backing device
+ *					-	REQ_PREFLUSH and REQ_FUA drain the store before they complete
+ *======================================================================================================
+ */
+
+/*
+ *	Backing I/O is never issued from the submission path: a bio submitted
+ *	from there only gets queued on current->bio_list, so waiting for it
+ *	would never end. The submitter hands the job to dev->cache_wq instead
+ *	and sleeps until it is done.
+ */
+struct ramdisk_cache_work {
+	struct work_struct work;
+	struct completion done;
+	struct ramdisk_dev *dev;
+	pgoff_t first;	/*	page range the job covers	*/
+	pgoff_t last;
+	int status;
 };
 
-static int ramdisk_major = 0;
-struct ramdisk_dev *dev;
-static unsigned int req = 0;
+static int ramdisk_cache_call(struct ramdisk_dev *dev, work_func_t fn,
+			      pgoff_t first, pgoff_t last)
+{
+	struct ramdisk_cache_work cw = {
+		.dev = dev,
+		.first = first,
+		.last = last,
+	};
+
+	INIT_WORK_ONSTACK(&cw.work, fn);
+	init_completion(&cw.done);
+	queue_work(dev->cache_wq, &cw.work);
+	wait_for_completion(&cw.done);
+	destroy_work_on_stack(&cw.work);
+	return cw.status;
+}
+
+/*
+ *	Read or write nr pages of the backing device starting at page idx.
+ *	Sleeps until the bio completes.
+ */
+static int ramdisk_backing_rw(struct ramdisk_dev *dev, pgoff_t idx,
+			      struct page **pages, unsigned int nr,
+			      unsigned int op)
+{
+	struct bio *bio;
+	unsigned int i;
+	int status;
+
+	bio = bio_alloc(GFP_NOIO, nr);
+	bio_set_dev(bio, dev->backing);
+	bio->bi_iter.bi_sector = (sector_t)idx << PAGE_SECTORS_SHIFT;
+	bio->bi_opf = op;
+	for (i = 0; i < nr; i++)
+		bio_add_page(bio, pages[i], PAGE_SIZE, 0);
+	status = submit_bio_wait(bio);
+	bio_put(bio);
+	return status;
+}
+
+static void ramdisk_cache_fetch_work(struct work_struct *work)
+{
+	struct ramdisk_cache_work *cw = container_of(work, struct ramdisk_cache_work, work);
+	struct ramdisk_dev *dev = cw->dev;
+	struct page *page;
+
+	page = alloc_page(GFP_NOIO);
+	if (NULL == page) {
+		cw->status = -ENOMEM;
+		goto out;
+	}
+	cw->status = ramdisk_backing_rw(dev, cw->first, &page, 1, REQ_OP_READ);
+	if (0 == cw->status) {
+		atomic64_inc(&dev->cache_fetched);
+		cw->status = ramdisk_insert_entry(dev, cw->first, page_address(page));
+	}
+	__free_page(page);
+out:
+	complete(&cw->done);
+}
+
+/*
+ *	Make sure page idx is in the store before it is read or partially
+ *	written. A write that gets there first wins over the fetched data.
+ */
+static int ramdisk_cache_fetch(struct ramdisk_dev *dev, pgoff_t idx)
+{
+	if (ramdisk_lookup(dev, idx))
+		return 0;
+	return ramdisk_cache_call(dev, ramdisk_cache_fetch_work, idx, idx + 1);
+}
+
+static bool ramdisk_cache_over_thresh(struct ramdisk_dev *dev)
+{
+	return atomic_long_read(&dev->nr_dirty) >= READ_ONCE(dev->dirty_thresh_pages);
+}
+
+static void ramdisk_cache_mark_dirty(struct ramdisk_dev *dev, pgoff_t idx)
+{
+	if (test_and_set_bit(idx, dev->dirty))
+		return;
+	/*	Wake the flusher once, when the threshold is crossed	*/
+	if (atomic_long_inc_return(&dev->nr_dirty) == READ_ONCE(dev->dirty_thresh_pages))
+		wake_up(&dev->flush_wait);
+}
+
+static void ramdisk_cache_clear_dirty(struct ramdisk_dev *dev, pgoff_t idx)
+{
+	if (test_and_clear_bit(idx, dev->dirty))
+		atomic_long_dec(&dev->nr_dirty);
+}
+
+/*
+ *	Write the dirty pages of [first, last) back, one bio per run of
+ *	adjacent dirty pages (at most WB_BATCH_PAGES long). Not to be called
+ *	from the submission path, see struct ramdisk_cache_work.
+ */
+static int ramdisk_cache_writeback(struct ramdisk_dev *dev, pgoff_t first,
+				   pgoff_t last)
+{
+	unsigned long start, end;
+	unsigned int i, nr;
+	int status = 0, err;
+
+	mutex_lock(&dev->wb_lock);
+	start = find_next_bit(dev->dirty, last, first);
+	while (start < last) {
+		end = find_next_zero_bit(dev->dirty,
+					 min_t(unsigned long, last, start + WB_BATCH_PAGES),
+					 start);
+		nr = end - start;
+		for (i = 0; i < nr; i++) {
+			/*	Cleared before the copy: a write racing with it sets it again	*/
+			ramdisk_cache_clear_dirty(dev, start + i);
+			rcu_read_lock();
+			ramdisk_read_chunk(dev, start + i, 0,
+					   page_address(dev->wb_pages[i]), PAGE_SIZE);
+			rcu_read_unlock();
+		}
+		err = ramdisk_backing_rw(dev, start, dev->wb_pages, nr, REQ_OP_WRITE);
+		if (err) {
+			for (i = 0; i < nr; i++)
+				ramdisk_cache_mark_dirty(dev, start + i);
+			status = err;
+		} else {
+			atomic64_add(nr, &dev->cache_flushed);
+		}
+		cond_resched();
+		start = find_next_bit(dev->dirty, last, end);
+	}
+	mutex_unlock(&dev->wb_lock);
+	return status;
+}
+
+static void ramdisk_cache_sync_work(struct work_struct *work)
+{
+	struct ramdisk_cache_work *cw = container_of(work, struct ramdisk_cache_work, work);
+	struct ramdisk_dev *dev = cw->dev;
+
+	cw->status = ramdisk_cache_writeback(dev, cw->first, cw->last);
+	if (0 == cw->status)
+		cw->status = blkdev_issue_flush(dev->backing, GFP_NOIO, NULL);
+	complete(&cw->done);
+}
+
+/*
+ *	Make pages [first, last) durable: write them back and flush the
+ *	backing device's own cache.
+ */
+static int ramdisk_cache_sync(struct ramdisk_dev *dev, pgoff_t first,
+			      pgoff_t last)
+{
+	return ramdisk_cache_call(dev, ramdisk_cache_sync_work, first, last);
+}
+
+/*
+ *	Discard whole pages: zero them on the backing device first, or they
+ *	would be fetched back, then forget them. wb_lock keeps the flusher from
+ *	writing them back in between.
+ */
+static void ramdisk_cache_discard_work(struct work_struct *work)
+{
+	struct ramdisk_cache_work *cw = container_of(work, struct ramdisk_cache_work, work);
+	struct ramdisk_dev *dev = cw->dev;
+	unsigned long idx;
+
+	mutex_lock(&dev->wb_lock);
+	cw->status = blkdev_issue_zeroout(dev->backing,
+					  (sector_t)cw->first << PAGE_SECTORS_SHIFT,
+					  (sector_t)(cw->last - cw->first) << PAGE_SECTORS_SHIFT,
+					  GFP_NOIO, 0);
+	if (0 == cw->status) {
+		idx = cw->first;
+		for_each_set_bit_from(idx, dev->dirty, cw->last)
+			ramdisk_cache_clear_dirty(dev, idx);
+		ramdisk_erase_range(dev, cw->first, cw->last);
+	}
+	mutex_unlock(&dev->wb_lock);
+	complete(&cw->done);
+}
+
+static int ramdisk_cache_flusher(void *data)
+{
+	struct ramdisk_dev *dev = data;
+	unsigned int ms;
+
+	while (!kthread_should_stop()) {
+		ms = READ_ONCE(dev->flush_interval_ms);
+		/*	An interval of 0 leaves only the threshold to trigger writeback	*/
+		wait_event_interruptible_timeout(dev->flush_wait,
+				kthread_should_stop() || ramdisk_cache_over_thresh(dev),
+				ms ? msecs_to_jiffies(ms) : MAX_SCHEDULE_TIMEOUT);
+		/*	Back off when the backing device fails instead of spinning	*/
+		if (ramdisk_cache_writeback(dev, 0, dev->nr_pages) && ms)
+			schedule_timeout_interruptible(msecs_to_jiffies(ms));
+	}
+	return 0;
+}
+
+static void ramdisk_cache_exit(struct ramdisk_dev *dev)
+{
+	unsigned int i;
+
+	if (dev->flusher)
+		kthread_stop(dev->flusher);
+	if (dev->cache_wq) {
+		/*	Nothing dirty may be lost on unload	*/
+		if (ramdisk_cache_writeback(dev, 0, dev->nr_pages) ||
+		    blkdev_issue_flush(dev->backing, GFP_KERNEL, NULL))
+			pr_emerg("Write back to %s failed, data lost\n", backing_dev);
+		destroy_workqueue(dev->cache_wq);
+	}
+	if (dev->wb_pages) {
+		for (i = 0; i < WB_BATCH_PAGES; i++) {
+			if (dev->wb_pages[i])
+				__free_page(dev->wb_pages[i]);
+		}
+		kfree(dev->wb_pages);
+	}
+	kvfree(dev->dirty);
+	blkdev_put(dev->backing, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+}
+
+/*
+ *	Open backing_dev and set up the cache. The disk takes the size of the
+ *	backing device, rounded down to whole pages.
+ */
+static int ramdisk_cache_init(struct ramdisk_dev *dev)
+{
+	unsigned int i;
+	int status;
+
+	dev->backing = blkdev_get_by_path(backing_dev,
+					  FMODE_READ | FMODE_WRITE | FMODE_EXCL, dev);
+	if (IS_ERR(dev->backing)) {
+		status = PTR_ERR(dev->backing);
+		dev->backing = NULL;
+		return status;
+	}
+	dev->nr_pages = i_size_read(dev->backing->bd_inode) >> PAGE_SHIFT;
+	if (0 == dev->nr_pages) {
+		blkdev_put(dev->backing, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		dev->backing = NULL;
+		return -EINVAL;
+	}
+
+	mutex_init(&dev->wb_lock);
+	init_waitqueue_head(&dev->flush_wait);
+	atomic_long_set(&dev->nr_dirty, 0);
+	dev->dirty_thresh_pages = cache_dirty_thresh_mb << (20 - PAGE_SHIFT);
+	dev->flush_interval_ms = cache_flush_interval_ms;
+
+	status = -ENOMEM;
+	dev->dirty = kvcalloc(BITS_TO_LONGS(dev->nr_pages), sizeof(unsigned long),
+			      GFP_KERNEL);
+	if (NULL == dev->dirty)
+		goto err;
+	dev->wb_pages = kcalloc(WB_BATCH_PAGES, sizeof(*dev->wb_pages), GFP_KERNEL);
+	if (NULL == dev->wb_pages)
+		goto err;
+	for (i = 0; i < WB_BATCH_PAGES; i++) {
+		dev->wb_pages[i] = alloc_page(GFP_KERNEL);
+		if (NULL == dev->wb_pages[i])
+			goto err;
+	}
+	dev->cache_wq = alloc_workqueue("ramdisk_cache", WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+	if (NULL == dev->cache_wq)
+		goto err;
+	dev->flusher = kthread_run(ramdisk_cache_flusher, dev, "ramdisk_flush");
+	if (IS_ERR(dev->flusher)) {
+		status = PTR_ERR(dev->flusher);
+		dev->flusher = NULL;
+		goto err;
+	}
+	return 0;
+
+err:
+	ramdisk_cache_exit(dev);
+	dev->backing = NULL;
+	return status;
+}
+
+/*======================================================================================================
+ *					I/O STATISTICS
+ *					-	ops, bytes and merges per I/O class, per CPU
+ *					-	log2 histogram of service times, per I/O class, per CPU
+ *					-	summed only when read from debugfs/ramdisk/ramdiskN/
+ *======================================================================================================
+ */
+
+static int ramdisk_stat_class(unsigned int opf, unsigned int bytes)
+{
+	switch (opf & REQ_OP_MASK) {
+	case REQ_OP_READ:
+		return RAMDISK_STAT_READ;
+	case REQ_OP_WRITE:
+		/*	A bio based flush is an empty write with REQ_PREFLUSH	*/
+		if (0 == bytes && (opf & REQ_PREFLUSH))
+			return RAMDISK_STAT_FLUSH;
+		return RAMDISK_STAT_WRITE;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		return RAMDISK_STAT_DISCARD;
+	case REQ_OP_FLUSH:
+		return RAMDISK_STAT_FLUSH;
+	default:
+		return -1;
+	}
+}
+
+/*
+ *	Count one finished op that started being served at start (ktime ns).
+ *	Only this CPU's counters are touched, so nothing is shared between
+ *	CPUs on the I/O path.
+ */
+static void ramdisk_account(struct ramdisk_dev *dev, unsigned int opf,
+			    unsigned int bytes, unsigned int merges, u64 start)
+{
+	int class = ramdisk_stat_class(opf, bytes);
+	u64 ns = ktime_get_ns() - start;
+	unsigned int bucket;
+
+	if (class < 0)
+		return;
+	bucket = min_t(unsigned int, ilog2(ns | 1), RAMDISK_LAT_BUCKETS - 1);
+	this_cpu_inc(dev->pcpu->ops[class]);
+	this_cpu_add(dev->pcpu->bytes[class], bytes);
+	if (merges)
+		this_cpu_add(dev->pcpu->merges[class], merges);
+	this_cpu_inc(dev->pcpu->lat[class][bucket]);
+}
+
+/*======================================================================================================
+ *					DATA PATH
+ *======================================================================================================
+ */
+
+/*
+ *	Copy len bytes from buf to off of page idx. May sleep.
+ */
+static int ramdisk_write_chunk(struct ramdisk_dev *dev, pgoff_t idx,
+			       unsigned int off, const u8 *buf, unsigned int len)
+{
+	int status;
+
+	/*	On a cache the rest of a partial page comes from the backing device	*/
+	if (dev->backing && PAGE_SIZE != len) {
+		status = ramdisk_cache_fetch(dev, idx);
+		if (status)
+			return status;
+	}
+	status = ramdisk_store_chunk(dev, idx, off, buf, len);
+	if (0 == status && dev->backing)
+		ramdisk_cache_mark_dirty(dev, idx);
+	return status;
+}
+
+/*
+ *	DISCARD and WRITE_ZEROES: drop every entry the range fully covers and
+ *	zero the partial pages at either end.
+ */
+static int ramdisk_discard(struct ramdisk_dev *dev, sector_t sector,
+			   unsigned int nr_sects)
+{
+	sector_t end = sector + nr_sects;
+	unsigned long first = DIV_ROUND_UP_ULL(sector, PAGE_SECTORS);
+	unsigned int off, chunk;
+	int status;
+
+	/*	Partial head and tail pages keep their other sectors	*/
+	while (sector < end) {
+		off = sector & (PAGE_SECTORS - 1);
+		chunk = min_t(sector_t, end - sector, PAGE_SECTORS - off);
+		if (PAGE_SECTORS == chunk) {
+			/*	Whole pages are handled below; skip to the tail	*/
+			sector = round_down(end, PAGE_SECTORS);
+			continue;
+		}
+		/*	On a cache, absent does not mean zero	*/
+		if (dev->backing || xa_load(&dev->pages, sector >> PAGE_SECTORS_SHIFT)) {
+			status = ramdisk_write_chunk(dev, sector >> PAGE_SECTORS_SHIFT,
+						     off << KERNEL_SECTOR_SHIFT,
+						     page_address(ZERO_PAGE(0)),
+						     chunk << KERNEL_SECTOR_SHIFT);
+			if (status)
+				return status;
+		}
+		sector += chunk;
+	}
+
+	if ((end >> PAGE_SECTORS_SHIFT) <= first)
+		return 0;
+	if (dev->backing)
+		return ramdisk_cache_call(dev, ramdisk_cache_discard_work, first,
+					  end >> PAGE_SECTORS_SHIFT);
+	ramdisk_erase_range(dev, first, end >> PAGE_SECTORS_SHIFT);
+	return 0;
+}
+
+/*
+ *	Copy engine: move one bio segment between its page and the store.
+ *	-	the bvec page is mapped exactly once
+ *	-	one chunk per backing page touched (a segment spans at most two)
+ */
+static blk_status_t ramdisk_xfer_bvec(struct ramdisk_dev *dev,
+				      struct bio_vec *bvec, sector_t sector,
+				      bool write)
+{
+	unsigned int len = bvec->bv_len;
+	unsigned int done, off, chunk;
+	/*	Reads outside cache mode never sleep, see ramdisk_rq_parks	*/
+	bool atomic = !write && NULL == dev->backing;
+	int status = 0;
+	u8 *buf;
+
+	/*	kmap otherwise: a write may sleep allocating its entry	*/
+	buf = (u8 *)(atomic ? kmap_atomic(bvec->bv_page) : kmap(bvec->bv_page)) +
+	      bvec->bv_offset;
+	for (done = 0; done < len; done += chunk) {
+		off = (sector & (PAGE_SECTORS - 1)) << KERNEL_SECTOR_SHIFT;
+		chunk = min_t(unsigned int, len - done, PAGE_SIZE - off);
+		if (write) {
+			status = ramdisk_write_chunk(dev, sector >> PAGE_SECTORS_SHIFT,
+						     off, buf + done, chunk);
+			if (status)
+				break;
+		} else {
+			if (dev->backing) {
+				status = ramdisk_cache_fetch(dev, sector >> PAGE_SECTORS_SHIFT);
+				if (status)
+					break;
+			}
+			rcu_read_lock();
+			ramdisk_read_chunk(dev, sector >> PAGE_SECTORS_SHIFT,
+					   off, buf + done, chunk);
+			rcu_read_unlock();
+		}
+		sector += chunk >> KERNEL_SECTOR_SHIFT;
+	}
+	if (!write)
+		flush_dcache_page(bvec->bv_page);
+	if (atomic)
+		kunmap_atomic(buf - bvec->bv_offset);
+	else
+		kunmap(bvec->bv_page);
+
+	return errno_to_blk_status(status);
+}
+
+/*
+ *	Front end shared by both I/O paths: checks the op and range and serves
+ *	everything that carries no data. Sets *xfer when the caller still has
+ *	to copy the segments, and then to finish with ramdisk_end_op.
+ */
+static blk_status_t ramdisk_handle_op(struct ramdisk_dev *dev, unsigned int opf,
+				      sector_t sector, unsigned int nr_sects,
+				      bool *xfer)
+{
+	unsigned int op = opf & REQ_OP_MASK;
+	int status;
+
+	*xfer = false;
+	switch (op) {
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		break;
+	case REQ_OP_FLUSH:
+		/*	Unless the store caches a backing device, a flush has no work to do	*/
+		if (dev->backing)
+			return errno_to_blk_status(ramdisk_cache_sync(dev, 0, dev->nr_pages));
+		return BLK_STS_OK;
+	default:
+		return BLK_STS_NOTSUPP;
+	}
+
+	if (sector + nr_sects > get_capacity(dev->gd))
+		return BLK_STS_IOERR;
+	if (dev->backing && (opf & REQ_PREFLUSH)) {
+		status = ramdisk_cache_sync(dev, 0, dev->nr_pages);
+		if (status)
+			return errno_to_blk_status(status);
+	}
+	/*	Unbacked pages read as zeroes: both ops just give pages back	*/
+	if (REQ_OP_DISCARD == op || REQ_OP_WRITE_ZEROES == op)
+		return errno_to_blk_status(ramdisk_discard(dev, sector, nr_sects));
+	*xfer = true;
+	return BLK_STS_OK;
+}
+
+/*
+ *	Last step of an op whose segments were copied. REQ_FUA needs nothing
+ *	extra when the store is all there is; on a cache the pages the write
+ *	touched go through to the backing device first.
+ */
+static blk_status_t ramdisk_end_op(struct ramdisk_dev *dev, unsigned int opf,
+				   sector_t sector, unsigned int nr_sects,
+				   blk_status_t status)
+{
+	if (status || NULL == dev->backing || !(opf & REQ_FUA))
+		return status;
+	return errno_to_blk_status(ramdisk_cache_sync(dev,
+			sector >> PAGE_SECTORS_SHIFT,
+			DIV_ROUND_UP_ULL(sector + nr_sects, PAGE_SECTORS)));
+}
+
+static blk_qc_t ramdisk_req_fn(struct request_queue *q, struct bio *bio)
+{
+	struct ramdisk_dev *dev = q->queuedata;
+	u64 start = ktime_get_ns();
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	sector_t sector;
+	bool write, xfer;
+
+	/*	Bio based: nothing else cuts a bio down to max_io_kb	*/
+	blk_queue_split(q, &bio);
+	sector = bio->bi_iter.bi_sector;
+	write = op_is_write(bio_op(bio));
+
+	bio->bi_status = ramdisk_handle_op(dev, bio->bi_opf, sector,
+					   bio_sectors(bio), &xfer);
+	if (xfer) {
+		bio_for_each_segment(bvec, bio, iter) {
+			bio->bi_status = ramdisk_xfer_bvec(dev, &bvec, sector, write);
+			if (bio->bi_status)
+				break;
+			sector += bvec.bv_len >> KERNEL_SECTOR_SHIFT;
+		}
+		bio->bi_status = ramdisk_end_op(dev, bio->bi_opf,
+						bio->bi_iter.bi_sector,
+						bio_sectors(bio), bio->bi_status);
+	}
+	ramdisk_account(dev, bio->bi_opf, bio->bi_iter.bi_size, 0, start);
+	bio_endio(bio);
+
+	return BLK_QC_T_NONE;
+}
+
+/*
+ *	Serve a started request and complete it.
+ */
+static void ramdisk_serve_rq(struct ramdisk_dev *dev, struct request *rq)
+{
+	sector_t sector = blk_rq_pos(rq);
+	bool write = op_is_write(req_op(rq));
+	u64 start = ktime_get_ns();
+	unsigned int nr_bios = 0;
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	blk_status_t status;
+	struct bio *bio;
+	bool xfer;
+
+	status = ramdisk_handle_op(dev, rq->cmd_flags, sector, blk_rq_sectors(rq),
+				   &xfer);
+	if (xfer) {
+		rq_for_each_segment(bvec, rq, iter) {
+			status = ramdisk_xfer_bvec(dev, &bvec, sector, write);
+			if (status)
+				break;
+			sector += bvec.bv_len >> KERNEL_SECTOR_SHIFT;
+		}
+		status = ramdisk_end_op(dev, rq->cmd_flags, blk_rq_pos(rq),
+					blk_rq_sectors(rq), status);
+	}
+	__rq_for_each_bio(bio, rq)
+		nr_bios++;
+	ramdisk_account(dev, rq->cmd_flags, blk_rq_bytes(rq),
+			nr_bios ? nr_bios - 1 : 0, start);
+	blk_mq_end_request(rq, status);
+}
+
+/*
+ *	Whether a request on a poll queue may wait for ramdisk_poll. blk_poll
+ *	can run with the submitter already in TASK_UNINTERRUPTIBLE, so only
+ *	requests that never sleep qualify: reads, outside cache mode. Writes
+ *	may allocate pages and cache mode waits for the backing device.
+ */
+static bool ramdisk_rq_parks(struct ramdisk_dev *dev, struct request *rq)
+{
+	return REQ_OP_READ == req_op(rq) && NULL == dev->backing;
+}
+
+/*
+ *	blk-mq entry point. Every hardware context runs this on its own CPU.
+ *	-	default queues serve the request inline and complete it at once
+ *	-	poll queues (REQ_HIPRI I/O) only park reads, which cannot block;
+ *		ramdisk_poll serves and completes them from the submitter's
+ *		polling loop. Everything else is served inline here, where
+ *		BLK_MQ_F_BLOCKING lets it sleep.
+ */
+static blk_status_t ramdisk_queue_rq(struct blk_mq_hw_ctx *hctx,
+				     const struct blk_mq_queue_data *bd)
+{
+	struct ramdisk_dev *dev = hctx->queue->queuedata;
+	struct ramdisk_poll_queue *pq = hctx->driver_data;
+	struct request *rq = bd->rq;
+
+	blk_mq_start_request(rq);
+	if (HCTX_TYPE_POLL == hctx->type && ramdisk_rq_parks(dev, rq)) {
+		spin_lock(&pq->lock);
+		list_add_tail(&rq->queuelist, &pq->list);
+		spin_unlock(&pq->lock);
+		return BLK_STS_OK;
+	}
+	ramdisk_serve_rq(dev, rq);
+
+	return BLK_STS_OK;
+}
+
+/*
+ *	Called by blk_poll for io_uring IOPOLL and RWF_HIPRI submitters.
+ *	Returns the number of requests completed.
+ */
+static int ramdisk_poll(struct blk_mq_hw_ctx *hctx)
+{
+	struct ramdisk_dev *dev = hctx->queue->queuedata;
+	struct ramdisk_poll_queue *pq = hctx->driver_data;
+	struct request *rq, *next;
+	LIST_HEAD(list);
+	int nr = 0;
+
+	spin_lock(&pq->lock);
+	list_splice_init(&pq->list, &list);
+	spin_unlock(&pq->lock);
+
+	list_for_each_entry_safe(rq, next, &list, queuelist) {
+		list_del_init(&rq->queuelist);
+		ramdisk_serve_rq(dev, rq);
+		nr++;
+	}
+	return nr;
+}
+
+static int ramdisk_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+			     unsigned int hctx_idx)
+{
+	struct ramdisk_dev *dev = data;
+	struct ramdisk_poll_queue *pq = &dev->pq[hctx_idx];
+
+	spin_lock_init(&pq->lock);
+	INIT_LIST_HEAD(&pq->list);
+	hctx->driver_data = pq;
+	return 0;
+}
+
+/*
+ *	Per CPU default queues first, then poll_queues poll queues. There are
+ *	no separate read queues: reads map to the default ones.
+ */
+static int ramdisk_map_queues(struct blk_mq_tag_set *set)
+{
+	unsigned int i, qoff = 0;
 
-#define MAX_SECTORS 20000
-#define SECT_SIZE	512
-#define KERNEL_SECTOR_SHIFT 9
-#define KERNEL_SECTOR_SIZE (1 << KERNEL_SECTOR_SHIFT)
+	for (i = 0; i < set->nr_maps; i++) {
+		struct blk_mq_queue_map *map = &set->map[i];
 
-static blk_qc_t ramdisk_req_fn(struct request_queue *q, struct bio *bio)
+		switch (i) {
+		case HCTX_TYPE_DEFAULT:
+			map->nr_queues = nr_cpu_ids;
+			break;
+		case HCTX_TYPE_POLL:
+			map->nr_queues = poll_queues;
+			break;
+		default:
+			map->nr_queues = 0;
+			continue;
+		}
+		map->queue_offset = qoff;
+		qoff += map->nr_queues;
+		blk_mq_map_queues(map);
+	}
+	return 0;
+}
+
+static const struct blk_mq_ops ramdisk_mq_ops = {
+	.queue_rq = ramdisk_queue_rq,
+	.init_hctx = ramdisk_init_hctx,
+	.map_queues = ramdisk_map_queues,
+	.poll = ramdisk_poll,
+};
+
+/*
+ *	Build the request queue for the selected queue_mode.
+ */
+static int ramdisk_alloc_queue(struct ramdisk_dev *dev)
 {
-	/*	Fix the request queue handling	*/
-	//struct ramdrv_dev *dev = q->queuedata;
-	//int status;
+	int status;
 
-	//status = ramdrv_xfer_bio(dev, bio);
-	pr_emerg("%s: %d REQ served\n", __func__, ++req);
- 	bio_endio(bio);
+	if (RAMDISK_Q_BIO == queue_mode) {
+		dev->queue = blk_alloc_queue(GFP_KERNEL);
+		if (NULL == dev->queue)
+			return -ENOMEM;
+		blk_queue_make_request(dev->queue, ramdisk_req_fn);
+		return 0;
+	}
 
-	return BLK_QC_T_NONE;
+	dev->tag_set.ops = &ramdisk_mq_ops;
+	dev->tag_set.nr_hw_queues = nr_cpu_ids + poll_queues;
+	dev->tag_set.nr_maps = poll_queues ? HCTX_MAX_TYPES : 1;
+	dev->tag_set.queue_depth = hw_queue_depth;
+	dev->tag_set.numa_node = dev->node >= 0 ? dev->node : NUMA_NO_NODE;
+	/*	queue_rq may sleep allocating a backing page	*/
+	dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+	dev->tag_set.driver_data = dev;
+	dev->pq = kcalloc(dev->tag_set.nr_hw_queues, sizeof(*dev->pq), GFP_KERNEL);
+	if (NULL == dev->pq)
+		return -ENOMEM;
+	status = blk_mq_alloc_tag_set(&dev->tag_set);
+	if (status)
+		goto err_free_pq;
+
+	dev->queue = blk_mq_init_queue(&dev->tag_set);
+	if (IS_ERR(dev->queue)) {
+		status = PTR_ERR(dev->queue);
+		dev->queue = NULL;
+		goto err_free_tag_set;
+	}
+	return 0;
+
+err_free_tag_set:
+	blk_mq_free_tag_set(&dev->tag_set);
+err_free_pq:
+	kfree(dev->pq);
+	return status;
+}
+
+static void ramdisk_free_queue(struct ramdisk_dev *dev)
+{
+	blk_cleanup_queue(dev->queue);
+	if (RAMDISK_Q_MQ == queue_mode) {
+		blk_mq_free_tag_set(&dev->tag_set);
+		kfree(dev->pq);
+	}
 }
 
+static int ramdisk_snapshot(struct ramdisk_dev *parent);
+static int ramdisk_delete(int id);
+
 static int ramdisk_open(struct block_device *device, fmode_t mode)
 {
 	struct ramdisk_dev *dev = device->bd_disk->private_data;
 	spin_lock(&dev->lock);
+	if (dev->dying) {
+		spin_unlock(&dev->lock);
+		return -ENXIO;
+	}
 	dev->users++;
 	spin_unlock(&dev->lock);
 	pr_emerg("RAM disk opened\n");
@@ -57,78 +1683,912 @@ static void ramdisk_release(struct gendisk *disk, fmode_t mode)
 	pr_emerg("RAM disk closed\n");
 }
 
+/*
+ *	Synchronous page I/O for the page cache (mpage readahead and writeback,
+ *	as on the raw device or ext2) and for swap: no bio is allocated, the
+ *	page is copied straight to or from the store.
+ *
+ *	This is as direct as a page backed disk gets. DAX is not possible here:
+ *	fs-dax wants ZONE_DEVICE memory set up by memremap_pages, not pages
+ *	from the page allocator (brd dropped DAX for the same reason).
+ */
+static int ramdisk_rw_page(struct block_device *bdev, sector_t sector,
+			   struct page *page, unsigned int op)
+{
+	struct ramdisk_dev *dev = bdev->bd_disk->private_data;
+	struct bio_vec bvec = {
+		.bv_page = page,
+		.bv_len = PAGE_SIZE,
+		.bv_offset = 0,
+	};
+	blk_status_t status;
+	u64 start;
+	bool xfer;
+	int err;
+
+	if (PageTransHuge(page))
+		return -ENOTSUPP;
+	start = ktime_get_ns();
+	status = ramdisk_handle_op(dev, op, sector, PAGE_SECTORS, &xfer);
+	if (xfer)
+		status = ramdisk_xfer_bvec(dev, &bvec, sector, op_is_write(op));
+	ramdisk_account(dev, op, PAGE_SIZE, 0, start);
+	err = blk_status_to_errno(status);
+	page_endio(page, op_is_write(op), err);
+	return err;
+}
+
+/*
+ *	Snapshot management, see ramdisk.h. Snapshots can be taken of any disk
+ *	but a cache, and of snapshots too.
+ */
+static int ramdisk_ioctl(struct block_device *bdev, fmode_t mode,
+			 unsigned int cmd, unsigned long arg)
+{
+	struct ramdisk_dev *dev = bdev->bd_disk->private_data;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	switch (cmd) {
+	case RAMDISK_IOC_SNAPSHOT:
+		return ramdisk_snapshot(dev);
+	case RAMDISK_IOC_DELETE:
+		if (arg > INT_MAX)
+			return -EINVAL;
+		return ramdisk_delete(arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 static struct block_device_operations ramdisk_ops = {
 	.owner = THIS_MODULE,
 	.open = ramdisk_open,
 	.release = ramdisk_release,
-	.ioctl = NULL
+	.rw_page = ramdisk_rw_page,
+	.ioctl = ramdisk_ioctl,
+	.compat_ioctl = ramdisk_ioctl,
 };
 
-static int __init init_ramdisk(void)
+/*======================================================================================================
+ *					SYSFS: /sys/block/ramdiskN/
+ *======================================================================================================
+ */
+
+static struct ramdisk_dev *to_ramdisk(struct device *d)
 {
-	int nsectors = MAX_SECTORS;
-	int hardsect_size = KERNEL_SECTOR_SIZE;
-	pr_emerg("Initializing RAM disk\n");
+	return dev_to_disk(d)->private_data;
+}
 
-	dev = kmalloc(sizeof(struct ramdisk_dev), GFP_KERNEL);
-	if (NULL == dev) {
-		pr_emerg("kmalloc failed\n");
+/*	Bytes of data held in the compressed store	*/
+static ssize_t orig_data_size_show(struct device *d,
+				   struct device_attribute *attr, char *buf)
+{
+	u64 pages = atomic64_read(&to_ramdisk(d)->zpages);
+
+	return sprintf(buf, "%llu\n", pages << PAGE_SHIFT);
+}
+static DEVICE_ATTR_RO(orig_data_size);
+
+/*	Bytes they take once compressed, raw pages included	*/
+static ssize_t compr_data_size_show(struct device *d,
+				    struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", (u64)atomic64_read(&to_ramdisk(d)->zsize));
+}
+static DEVICE_ATTR_RO(compr_data_size);
+
+static ssize_t incompressible_pages_show(struct device *d,
+					 struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", (u64)atomic64_read(&to_ramdisk(d)->zraw_pages));
+}
+static DEVICE_ATTR_RO(incompressible_pages);
+
+static ssize_t comp_time_ns_show(struct device *d,
+				 struct device_attribute *attr, char *buf)
+{
+	struct ramdisk_dev *dev = to_ramdisk(d);
+	u64 ns = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		ns += per_cpu_ptr(dev->zstrm, cpu)->comp_ns;
+	return sprintf(buf, "%llu\n", ns);
+}
+static DEVICE_ATTR_RO(comp_time_ns);
+
+static ssize_t decomp_time_ns_show(struct device *d,
+				   struct device_attribute *attr, char *buf)
+{
+	struct ramdisk_dev *dev = to_ramdisk(d);
+	u64 ns = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		ns += per_cpu_ptr(dev->zstrm, cpu)->decomp_ns;
+	return sprintf(buf, "%llu\n", ns);
+}
+static DEVICE_ATTR_RO(decomp_time_ns);
+
+static struct attribute *ramdisk_comp_attrs[] = {
+	&dev_attr_orig_data_size.attr,
+	&dev_attr_compr_data_size.attr,
+	&dev_attr_incompressible_pages.attr,
+	&dev_attr_comp_time_ns.attr,
+	&dev_attr_decomp_time_ns.attr,
+	NULL,
+};
+
+static umode_t ramdisk_comp_attr_visible(struct kobject *kobj,
+					 struct attribute *attr, int n)
+{
+	return to_ramdisk(kobj_to_dev(kobj))->compress ? attr->mode : 0;
+}
+
+static const struct attribute_group ramdisk_comp_attr_group = {
+	.attrs = ramdisk_comp_attrs,
+	.is_visible = ramdisk_comp_attr_visible,
+};
+
+static ssize_t same_pages_show(struct device *d,
+			       struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", (u64)atomic64_read(&to_ramdisk(d)->same_pages));
+}
+static DEVICE_ATTR_RO(same_pages);
+
+/*	Memory the fill entries stand in for	*/
+static ssize_t same_saved_bytes_show(struct device *d,
+				     struct device_attribute *attr, char *buf)
+{
+	u64 pages = atomic64_read(&to_ramdisk(d)->same_pages);
+
+	return sprintf(buf, "%llu\n", pages << PAGE_SHIFT);
+}
+static DEVICE_ATTR_RO(same_saved_bytes);
+
+/*	Hit rate is same_hits / same_checks	*/
+static ssize_t same_checks_show(struct device *d,
+				struct device_attribute *attr, char *buf)
+{
+	struct ramdisk_dev *dev = to_ramdisk(d);
+	u64 n = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		n += per_cpu_ptr(dev->pcpu, cpu)->same_checks;
+	return sprintf(buf, "%llu\n", n);
+}
+static DEVICE_ATTR_RO(same_checks);
+
+static ssize_t same_hits_show(struct device *d,
+			      struct device_attribute *attr, char *buf)
+{
+	struct ramdisk_dev *dev = to_ramdisk(d);
+	u64 n = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		n += per_cpu_ptr(dev->pcpu, cpu)->same_hits;
+	return sprintf(buf, "%llu\n", n);
+}
+static DEVICE_ATTR_RO(same_hits);
+
+static struct attribute *ramdisk_same_attrs[] = {
+	&dev_attr_same_pages.attr,
+	&dev_attr_same_saved_bytes.attr,
+	&dev_attr_same_checks.attr,
+	&dev_attr_same_hits.attr,
+	NULL,
+};
+
+static umode_t ramdisk_same_attr_visible(struct kobject *kobj,
+					 struct attribute *attr, int n)
+{
+	return to_ramdisk(kobj_to_dev(kobj))->same_fill ? attr->mode : 0;
+}
+
+static const struct attribute_group ramdisk_same_attr_group = {
+	.attrs = ramdisk_same_attrs,
+	.is_visible = ramdisk_same_attr_visible,
+};
+
+static ssize_t cache_dirty_pages_show(struct device *d,
+				      struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%ld\n", atomic_long_read(&to_ramdisk(d)->nr_dirty));
+}
+static DEVICE_ATTR_RO(cache_dirty_pages);
+
+static ssize_t cache_fetched_pages_show(struct device *d,
+					struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", (u64)atomic64_read(&to_ramdisk(d)->cache_fetched));
+}
+static DEVICE_ATTR_RO(cache_fetched_pages);
+
+static ssize_t cache_flushed_pages_show(struct device *d,
+					struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", (u64)atomic64_read(&to_ramdisk(d)->cache_flushed));
+}
+static DEVICE_ATTR_RO(cache_flushed_pages);
+
+static ssize_t cache_dirty_thresh_mb_show(struct device *d,
+					  struct device_attribute *attr, char *buf)
+{
+	unsigned long pages = READ_ONCE(to_ramdisk(d)->dirty_thresh_pages);
+
+	return sprintf(buf, "%lu\n", pages >> (20 - PAGE_SHIFT));
+}
+
+static ssize_t cache_dirty_thresh_mb_store(struct device *d,
+					   struct device_attribute *attr,
+					   const char *buf, size_t len)
+{
+	struct ramdisk_dev *dev = to_ramdisk(d);
+	unsigned long mb;
+	int status;
+
+	status = kstrtoul(buf, 0, &mb);
+	if (status)
+		return status;
+	if (0 == mb)
+		return -EINVAL;
+	WRITE_ONCE(dev->dirty_thresh_pages, mb << (20 - PAGE_SHIFT));
+	/*	Lowering it may have put us over already	*/
+	wake_up(&dev->flush_wait);
+	return len;
+}
+static DEVICE_ATTR_RW(cache_dirty_thresh_mb);
+
+static ssize_t cache_flush_interval_ms_show(struct device *d,
+					    struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", READ_ONCE(to_ramdisk(d)->flush_interval_ms));
+}
+
+static ssize_t cache_flush_interval_ms_store(struct device *d,
+					     struct device_attribute *attr,
+					     const char *buf, size_t len)
+{
+	struct ramdisk_dev *dev = to_ramdisk(d);
+	unsigned int ms;
+	int status;
+
+	status = kstrtouint(buf, 0, &ms);
+	if (status)
+		return status;
+	WRITE_ONCE(dev->flush_interval_ms, ms);
+	/*	The flusher may be sleeping on the old interval	*/
+	wake_up(&dev->flush_wait);
+	return len;
+}
+static DEVICE_ATTR_RW(cache_flush_interval_ms);
+
+static struct attribute *ramdisk_cache_attrs[] = {
+	&dev_attr_cache_dirty_pages.attr,
+	&dev_attr_cache_fetched_pages.attr,
+	&dev_attr_cache_flushed_pages.attr,
+	&dev_attr_cache_dirty_thresh_mb.attr,
+	&dev_attr_cache_flush_interval_ms.attr,
+	NULL,
+};
+
+static umode_t ramdisk_cache_attr_visible(struct kobject *kobj,
+					  struct attribute *attr, int n)
+{
+	return to_ramdisk(kobj_to_dev(kobj))->backing ? attr->mode : 0;
+}
+
+static const struct attribute_group ramdisk_cache_attr_group = {
+	.attrs = ramdisk_cache_attrs,
+	.is_visible = ramdisk_cache_attr_visible,
+};
+
+/*	Write anything to take a snapshot; it shows up as a new ramdiskN	*/
+static ssize_t snapshot_store(struct device *d, struct device_attribute *attr,
+			      const char *buf, size_t len)
+{
+	int status = ramdisk_snapshot(to_ramdisk(d));
+
+	return status < 0 ? status : len;
+}
+static DEVICE_ATTR_WO(snapshot);
+
+static ssize_t cow_faults_show(struct device *d,
+			       struct device_attribute *attr, char *buf)
+{
+	struct ramdisk_dev *dev = to_ramdisk(d);
+	u64 n = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		n += per_cpu_ptr(dev->pcpu, cpu)->cow_faults;
+	return sprintf(buf, "%llu\n", n);
+}
+static DEVICE_ATTR_RO(cow_faults);
+
+/*
+ *	Entries held by more than one disk, and the holds on them. Walks the
+ *	whole store, so it costs as much as the disk has entries. Fill entries
+ *	are not counted: a snapshot gets its own copy of the word, which takes
+ *	no memory of its own.
+ */
+static ssize_t shared_pages_show(struct device *d,
+				 struct device_attribute *attr, char *buf)
+{
+	struct ramdisk_dev *dev = to_ramdisk(d);
+	XA_STATE(xas, &dev->pages, 0);
+	u64 pages = 0, refs = 0;
+	unsigned int n;
+	void *entry;
+
+	rcu_read_lock();
+	xas_for_each(&xas, entry, ULONG_MAX) {
+		if (xas_retry(&xas, entry))
+			continue;
+		n = ramdisk_entry_refs(dev, entry);
+		if (n > 1) {
+			pages++;
+			refs += n;
+		}
+		if (need_resched()) {
+			xas_pause(&xas);
+			rcu_read_unlock();
+			cond_resched();
+			rcu_read_lock();
+		}
+	}
+	rcu_read_unlock();
+	return sprintf(buf, "%llu %llu\n", pages, refs);
+}
+static DEVICE_ATTR_RO(shared_pages);
+
+static struct attribute *ramdisk_snap_attrs[] = {
+	&dev_attr_snapshot.attr,
+	&dev_attr_cow_faults.attr,
+	&dev_attr_shared_pages.attr,
+	NULL,
+};
+
+static umode_t ramdisk_snap_attr_visible(struct kobject *kobj,
+					 struct attribute *attr, int n)
+{
+	return to_ramdisk(kobj_to_dev(kobj))->backing ? 0 : attr->mode;
+}
+
+static const struct attribute_group ramdisk_snap_attr_group = {
+	.attrs = ramdisk_snap_attrs,
+	.is_visible = ramdisk_snap_attr_visible,
+};
+
+static ssize_t numa_node_show(struct device *d,
+			      struct device_attribute *attr, char *buf)
+{
+	int node = to_ramdisk(d)->node;
+
+	if (RAMDISK_NODE_INTERLEAVE == node)
+		return sprintf(buf, "interleave\n");
+	return sprintf(buf, "%d\n", node);
+}
+static DEVICE_ATTR_RO(numa_node);
+
+/*
+ *	Where the backing pages really are, as N<node>=<pages> like numa_maps.
+ *	Fill entries have no page and are left out. Walks the whole store.
+ */
+static ssize_t node_pages_show(struct device *d,
+			       struct device_attribute *attr, char *buf)
+{
+	struct ramdisk_dev *dev = to_ramdisk(d);
+	XA_STATE(xas, &dev->pages, 0);
+	struct ramdisk_zpage *zp;
+	ssize_t len = 0;
+	void *entry;
+	u64 *pages;
+	int nid;
+
+	pages = kcalloc(nr_node_ids, sizeof(*pages), GFP_KERNEL);
+	if (NULL == pages)
 		return -ENOMEM;
+	rcu_read_lock();
+	xas_for_each(&xas, entry, ULONG_MAX) {
+		if (xas_retry(&xas, entry) || xa_is_value(entry))
+			continue;
+		if (!dev->compress) {
+			nid = page_to_nid(entry);
+		} else {
+			zp = entry;
+			nid = page_to_nid(zp->raw ? zp->raw : virt_to_page(zp));
+		}
+		pages[nid]++;
+		if (need_resched()) {
+			xas_pause(&xas);
+			rcu_read_unlock();
+			cond_resched();
+			rcu_read_lock();
+		}
 	}
-	memset(dev, 0, sizeof(struct ramdisk_dev));
+	rcu_read_unlock();
 
-	ramdisk_major = register_blkdev(ramdisk_major, "ramdisk");
-	if (ramdisk_major <= 0) {
-		pr_emerg("Error in getting the major number: %d\n", ramdisk_major);
-		return -EBUSY;
+	for_each_node_state(nid, N_MEMORY)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%sN%d=%llu",
+				 len ? " " : "", nid, pages[nid]);
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	kfree(pages);
+	return len;
+}
+static DEVICE_ATTR_RO(node_pages);
+
+static struct attribute *ramdisk_numa_attrs[] = {
+	&dev_attr_numa_node.attr,
+	&dev_attr_node_pages.attr,
+	NULL,
+};
+
+static const struct attribute_group ramdisk_numa_attr_group = {
+	.attrs = ramdisk_numa_attrs,
+};
+
+static const struct attribute_group *ramdisk_attr_groups[] = {
+	&ramdisk_comp_attr_group,
+	&ramdisk_same_attr_group,
+	&ramdisk_cache_attr_group,
+	&ramdisk_snap_attr_group,
+	&ramdisk_numa_attr_group,
+	NULL,
+};
+
+/*======================================================================================================
+ *					DEBUGFS: /sys/kernel/debug/ramdisk/ramdiskN/
+ *					-	stats: ops, bytes and merges per I/O class
+ *					-	latency: service time histogram per I/O class
+ *======================================================================================================
+ */
+
+static struct dentry *ramdisk_debugfs;
+
+static const char * const ramdisk_stat_names[RAMDISK_STAT_NR] = {
+	[RAMDISK_STAT_READ]	= "read",
+	[RAMDISK_STAT_WRITE]	= "write",
+	[RAMDISK_STAT_DISCARD]	= "discard",
+	[RAMDISK_STAT_FLUSH]	= "flush",
+};
+
+static int ramdisk_stats_show(struct seq_file *m, void *v)
+{
+	struct ramdisk_dev *dev = m->private;
+	struct ramdisk_pcpu *pc;
+	u64 ops, bytes, merges;
+	int class, cpu;
+
+	seq_printf(m, "%-8s %16s %20s %16s\n", "", "ops", "bytes", "merges");
+	for (class = 0; class < RAMDISK_STAT_NR; class++) {
+		ops = bytes = merges = 0;
+		for_each_possible_cpu(cpu) {
+			pc = per_cpu_ptr(dev->pcpu, cpu);
+			ops += pc->ops[class];
+			bytes += pc->bytes[class];
+			merges += pc->merges[class];
+		}
+		seq_printf(m, "%-8s %16llu %20llu %16llu\n",
+			   ramdisk_stat_names[class], ops, bytes, merges);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ramdisk_stats);
+
+/*
+ *	One block per I/O class that saw any I/O, one line per non empty
+ *	bucket: lower bound of the bucket in ns, then the count.
+ */
+static int ramdisk_latency_show(struct seq_file *m, void *v)
+{
+	struct ramdisk_dev *dev = m->private;
+	u64 hist[RAMDISK_LAT_BUCKETS];
+	int class, cpu, b;
+	u64 total;
+
+	for (class = 0; class < RAMDISK_STAT_NR; class++) {
+		memset(hist, 0, sizeof(hist));
+		total = 0;
+		for_each_possible_cpu(cpu) {
+			for (b = 0; b < RAMDISK_LAT_BUCKETS; b++)
+				hist[b] += per_cpu_ptr(dev->pcpu, cpu)->lat[class][b];
+		}
+		for (b = 0; b < RAMDISK_LAT_BUCKETS; b++)
+			total += hist[b];
+		if (0 == total)
+			continue;
+		seq_printf(m, "%s (ns):\n", ramdisk_stat_names[class]);
+		for (b = 0; b < RAMDISK_LAT_BUCKETS; b++) {
+			if (hist[b])
+				seq_printf(m, "%12llu %16llu\n", 1ULL << b, hist[b]);
+		}
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ramdisk_latency);
+
+static void ramdisk_debugfs_add(struct ramdisk_dev *dev)
+{
+	dev->debugfs = debugfs_create_dir(dev->gd->disk_name, ramdisk_debugfs);
+	debugfs_create_file("stats", 0444, dev->debugfs, dev, &ramdisk_stats_fops);
+	debugfs_create_file("latency", 0444, dev->debugfs, dev, &ramdisk_latency_fops);
+}
+
+/*======================================================================================================
+ *					DEVICES
+ *					-	ramdisk0 is set up from the module parameters at load
+ *					-	snapshots add ramdisk1, ramdisk2, ... sharing every page
+ *						with their parent until one side writes it
+ *======================================================================================================
+ */
+
+/*
+ *	Set up a disk as cfg describes it. It is not visible until ramdisk_add.
+ */
+static struct ramdisk_dev *ramdisk_create(const struct ramdisk_config *cfg)
+{
+	sector_t nsectors = cfg->nsectors;
+	struct ramdisk_dev *dev;
+	int status;
+
+	dev = kzalloc_node(sizeof(struct ramdisk_dev), GFP_KERNEL,
+			   cfg->node >= 0 ? cfg->node : NUMA_NO_NODE);
+	if (NULL == dev) {
+		pr_emerg("kmalloc failed\n");
+		return ERR_PTR(-ENOMEM);
 	}
-	
+	dev->id = ida_alloc_max(&ramdisk_ida, MINORMASK, GFP_KERNEL);
+	if (dev->id < 0) {
+		status = dev->id;
+		goto err_free_dev;
+	}
+
 	spin_lock_init(&dev->lock);
-	dev->size = nsectors * hardsect_size;
-	dev->data = vmalloc(dev->size);
-	if (NULL == dev->data)	{
-		pr_emerg("Unable to allocate memory\n");
-		return -ENOMEM;
+	INIT_LIST_HEAD(&dev->list);
+	dev->size = (u64)nsectors << KERNEL_SECTOR_SHIFT;
+	dev->node = cfg->node;
+	xa_init(&dev->pages);
+
+	dev->pcpu = alloc_percpu(struct ramdisk_pcpu);
+	if (NULL == dev->pcpu) {
+		status = -ENOMEM;
+		goto err_free_id;
+	}
+	dev->same_fill = same_fill;
+	dev->compress = compress;
+	if (dev->compress) {
+		status = ramdisk_zinit(dev);
+		if (status) {
+			pr_emerg("Unable to set up %s compression: %d\n", comp_alg, status);
+			goto err_free_pcpu;
+		}
+	}
+
+	if (cfg->cache) {
+		status = ramdisk_cache_init(dev);
+		if (status) {
+			pr_emerg("Unable to cache %s: %d\n", backing_dev, status);
+			goto err_zexit;
+		}
+		nsectors = (sector_t)dev->nr_pages << PAGE_SECTORS_SHIFT;
+		dev->size = (u64)nsectors << KERNEL_SECTOR_SHIFT;
 	}
 
-	dev->queue = blk_alloc_queue(GFP_KERNEL);
-	blk_queue_make_request(dev->queue, ramdisk_req_fn);
-	blk_queue_logical_block_size(dev->queue, hardsect_size);
-	blk_queue_physical_block_size(dev->queue, hardsect_size);
+	status = ramdisk_alloc_queue(dev);
+	if (status) {
+		pr_emerg("Unable to allocate request queue: %d\n", status);
+		goto err_cache_exit;
+	}
+	blk_queue_logical_block_size(dev->queue, cfg->logical_block_size);
+	blk_queue_physical_block_size(dev->queue, cfg->physical_block_size);
+	blk_queue_io_min(dev->queue, cfg->physical_block_size);
+	blk_queue_max_hw_sectors(dev->queue, cfg->max_io_sectors);
+	/*	Memory has no seek penalty and is no source of entropy	*/
+	blk_queue_flag_set(QUEUE_FLAG_NONROT, dev->queue);
+	blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, dev->queue);
+	/*	fstrim / blkdiscard hand whole pages back to the system	*/
+	blk_queue_flag_set(QUEUE_FLAG_DISCARD, dev->queue);
+	dev->queue->limits.discard_granularity = PAGE_SIZE;
+	blk_queue_max_discard_sectors(dev->queue, UINT_MAX >> KERNEL_SECTOR_SHIFT);
+	blk_queue_max_write_zeroes_sectors(dev->queue, UINT_MAX >> KERNEL_SECTOR_SHIFT);
+	/*	A cache is volatile: have flushes and FUA passed down to us	*/
+	if (dev->backing)
+		blk_queue_write_cache(dev->queue, true, true);
 	dev->queue->queuedata = dev;
 
 	dev->gd = alloc_disk(1);
 	if (NULL == dev->gd) {
-        pr_emerg("Unable to allocate gendisk\n");
-        return -ENOMEM;
+		pr_emerg("Unable to allocate gendisk\n");
+		status = -ENOMEM;
+		goto err_free_queue;
 	}
-	pr_emerg("%s: %d\n", __func__, __LINE__);
 	dev->gd->major = ramdisk_major;
-	dev->gd->first_minor = 0;
+	dev->gd->first_minor = dev->id;
 	dev->gd->queue = dev->queue;
 	dev->gd->fops = &ramdisk_ops;
 	dev->gd->private_data = (void *)dev;
-	snprintf (dev->gd->disk_name, 32, "ramdisk0");
+	snprintf (dev->gd->disk_name, 32, "ramdisk%d", dev->id);
 	set_capacity(dev->gd, nsectors);
-	add_disk(dev->gd);
 
-	return 0;
+	return dev;
+
+err_free_queue:
+	ramdisk_free_queue(dev);
+err_cache_exit:
+	if (dev->backing)
+		ramdisk_cache_exit(dev);
+err_zexit:
+	if (dev->compress)
+		ramdisk_zexit(dev);
+err_free_pcpu:
+	free_percpu(dev->pcpu);
+err_free_id:
+	ida_free(&ramdisk_ida, dev->id);
+err_free_dev:
+	kfree(dev);
+	return ERR_PTR(status);
 }
 
-static void __exit exit_ramdisk(void)
+static void ramdisk_add(struct ramdisk_dev *dev)
 {
-	pr_emerg("Exiting RAMDISK!\n");
-	if (dev->gd) {
+	device_add_disk(NULL, dev->gd, ramdisk_attr_groups);
+	ramdisk_debugfs_add(dev);
+	mutex_lock(&ramdisk_list_lock);
+	list_add_tail(&dev->list, &ramdisk_list);
+	mutex_unlock(&ramdisk_list_lock);
+}
+
+/*
+ *	Tear down a disk that is off ramdisk_list. Its entries are only freed
+ *	by the last disk sharing them.
+ */
+static void ramdisk_destroy(struct ramdisk_dev *dev)
+{
+	debugfs_remove_recursive(dev->debugfs);
+	if (dev->gd->flags & GENHD_FL_UP)
 		del_gendisk(dev->gd);
-		put_disk(dev->gd);
+	put_disk(dev->gd);
+	ramdisk_free_queue(dev);
+	/*	No more I/O: write back what is left while the store is still there	*/
+	if (dev->backing)
+		ramdisk_cache_exit(dev);
+	ramdisk_free_pages(dev);
+	if (dev->compress)
+		ramdisk_zexit(dev);
+	free_percpu(dev->pcpu);
+	ida_free(&ramdisk_ida, dev->id);
+	kfree(dev);
+}
+
+/*
+ *	Give child a hold on every entry of parent. Costs one store per entry
+ *	the parent has, whatever the size of the disk. The parent's queue is
+ *	frozen meanwhile, so no write is halfway through a page being shared.
+ */
+static int ramdisk_share_pages(struct ramdisk_dev *parent,
+			       struct ramdisk_dev *child)
+{
+	unsigned long idx;
+	void *entry, *old;
+	int status = 0;
+
+	blk_mq_freeze_queue(parent->queue);
+	xa_for_each(&parent->pages, idx, entry) {
+		ramdisk_get_entry(child, entry);
+		/*	GFP_NOIO: the parent may be what reclaim would write to	*/
+		old = xa_store(&child->pages, idx, entry, GFP_NOIO);
+		if (xa_is_err(old)) {
+			ramdisk_free_entry(child, entry);
+			status = xa_err(old);
+			break;
+		}
+		/*	zpages and fill entries are never written in place	*/
+		if (!xa_is_value(entry) && !parent->compress) {
+			xa_set_mark(&parent->pages, idx, RAMDISK_SHARED);
+			xa_set_mark(&child->pages, idx, RAMDISK_SHARED);
+		}
+		cond_resched();
+	}
+	blk_mq_unfreeze_queue(parent->queue);
+	return status;
+}
+
+/*
+ *	Create a new disk with the contents of parent. Returns its index.
+ */
+static int ramdisk_snapshot(struct ramdisk_dev *parent)
+{
+	struct ramdisk_config cfg = {
+		.nsectors = get_capacity(parent->gd),
+		.logical_block_size = queue_logical_block_size(parent->queue),
+		.physical_block_size = queue_physical_block_size(parent->queue),
+		.max_io_sectors = queue_max_hw_sectors(parent->queue),
+		.node = parent->node,
+	};
+	struct ramdisk_dev *child;
+	int status;
+
+	/*	Pages of a cache may only be on the backing device	*/
+	if (parent->backing)
+		return -EOPNOTSUPP;
+	child = ramdisk_create(&cfg);
+	if (IS_ERR(child))
+		return PTR_ERR(child);
+	status = ramdisk_share_pages(parent, child);
+	if (status) {
+		ramdisk_destroy(child);
+		return status;
+	}
+	ramdisk_add(child);
+	pr_emerg("%s: snapshot of %s\n", child->gd->disk_name, parent->gd->disk_name);
+	return child->id;
+}
+
+static int ramdisk_delete(int id)
+{
+	struct ramdisk_dev *dev;
+	int status = -ENODEV;
+
+	mutex_lock(&ramdisk_list_lock);
+	list_for_each_entry(dev, &ramdisk_list, list) {
+		if (dev->id != id)
+			continue;
+		spin_lock(&dev->lock);
+		if (dev->users) {
+			status = -EBUSY;
+		} else {
+			dev->dying = true;
+			list_del(&dev->list);
+			status = 0;
+		}
+		spin_unlock(&dev->lock);
+		break;
+	}
+	mutex_unlock(&ramdisk_list_lock);
+	if (0 == status)
+		ramdisk_destroy(dev);
+	return status;
+}
+
+/*
+ *	Fill cfg for disk i from the module parameters.
+ */
+static int __init ramdisk_get_config(unsigned int i, struct ramdisk_config *cfg)
+{
+	unsigned long size_mb = ramdisk_param(disk_size_mb, i);
+	unsigned int io_kb = ramdisk_param(max_io_kb, i);
+
+	if (0 == size_mb) {
+		pr_emerg("ramdisk%u: disk_size_mb must be non zero\n", i);
+		return -EINVAL;
 	}
-	if (dev->queue) {
-		blk_cleanup_queue(dev->queue);
+	cfg->nsectors = (sector_t)size_mb << (20 - KERNEL_SECTOR_SHIFT);
+
+	/*	Compressed disks must use PAGE_SIZE logical blocks, see compress	*/
+	cfg->logical_block_size = ramdisk_param(logical_block_size, i);
+	if (0 == cfg->logical_block_size)
+		cfg->logical_block_size = compress ? PAGE_SIZE : KERNEL_SECTOR_SIZE;
+	if (!is_power_of_2(cfg->logical_block_size) ||
+	    cfg->logical_block_size < KERNEL_SECTOR_SIZE ||
+	    cfg->logical_block_size > PAGE_SIZE ||
+	    (compress && PAGE_SIZE != cfg->logical_block_size)) {
+		pr_emerg("ramdisk%u: invalid logical_block_size: %u\n", i,
+			 cfg->logical_block_size);
+		return -EINVAL;
 	}
-	if (dev->data) {
-		vfree(dev->data);
+	cfg->physical_block_size = ramdisk_param(physical_block_size, i);
+	if (0 == cfg->physical_block_size)
+		cfg->physical_block_size = cfg->logical_block_size;
+	if (!is_power_of_2(cfg->physical_block_size) ||
+	    cfg->physical_block_size < cfg->logical_block_size) {
+		pr_emerg("ramdisk%u: invalid physical_block_size: %u\n", i,
+			 cfg->physical_block_size);
+		return -EINVAL;
 	}
-	kfree(dev);
+	/*	The block layer wants at least a page per request	*/
+	if ((unsigned long)io_kb << 10 < PAGE_SIZE || io_kb > (UINT_MAX >> 1)) {
+		pr_emerg("ramdisk%u: invalid max_io_kb: %u\n", i, io_kb);
+		return -EINVAL;
+	}
+	cfg->max_io_sectors = io_kb << 1;
+
+	cfg->node = ramdisk_param(numa_node, i);
+	if (NUMA_NO_NODE != cfg->node && RAMDISK_NODE_INTERLEAVE != cfg->node &&
+	    (cfg->node < 0 || cfg->node >= MAX_NUMNODES ||
+	     !node_state(cfg->node, N_MEMORY))) {
+		pr_emerg("ramdisk%u: no memory on numa_node %d\n", i, cfg->node);
+		return -EINVAL;
+	}
+	cfg->cache = 0 == i && NULL != backing_dev;
+	return 0;
+}
+
+static void ramdisk_destroy_all(void)
+{
+	struct ramdisk_dev *dev, *next;
+
+	list_for_each_entry_safe_reverse(dev, next, &ramdisk_list, list) {
+		list_del(&dev->list);
+		ramdisk_destroy(dev);
+	}
+}
+
+static int __init init_ramdisk(void)
+{
+	struct ramdisk_config cfg;
+	struct ramdisk_dev *dev;
+	unsigned int i;
+	int status, nid;
+	pr_emerg("Initializing RAM disk\n");
+
+	if (RAMDISK_Q_BIO != queue_mode && RAMDISK_Q_MQ != queue_mode) {
+		pr_emerg("Invalid queue_mode: %d\n", queue_mode);
+		return -EINVAL;
+	}
+	if (0 == nr_disks || nr_disks > RAMDISK_MAX_DISKS) {
+		pr_emerg("nr_disks must be 1 to %d\n", RAMDISK_MAX_DISKS);
+		return -EINVAL;
+	}
+	if (0 == hw_queue_depth) {
+		pr_emerg("hw_queue_depth must be non zero\n");
+		return -EINVAL;
+	}
+	if (poll_queues > nr_cpu_ids) {
+		pr_emerg("poll_queues must not exceed %u\n", nr_cpu_ids);
+		return -EINVAL;
+	}
+	if (backing_dev && 0 == cache_dirty_thresh_mb) {
+		pr_emerg("cache_dirty_thresh_mb must be non zero\n");
+		return -EINVAL;
+	}
+	for (i = 0; i < nr_disks; i++) {
+		status = ramdisk_get_config(i, &cfg);
+		if (status)
+			return status;
+	}
+
+	for_each_node_state(nid, N_MEMORY)
+		ramdisk_nodes[ramdisk_nr_nodes++] = nid;
+
+	if (!rw_page)
+		ramdisk_ops.rw_page = NULL;
+
+	ramdisk_major = register_blkdev(ramdisk_major, "ramdisk");
+	if (ramdisk_major <= 0) {
+		pr_emerg("Error in getting the major number: %d\n", ramdisk_major);
+		return -EBUSY;
+	}
+	/*	Statistics are a debugging aid: the disks work without debugfs	*/
+	ramdisk_debugfs = debugfs_create_dir("ramdisk", NULL);
+
+	for (i = 0; i < nr_disks; i++) {
+		ramdisk_get_config(i, &cfg);
+		dev = ramdisk_create(&cfg);
+		if (IS_ERR(dev)) {
+			ramdisk_destroy_all();
+			debugfs_remove_recursive(ramdisk_debugfs);
+			unregister_blkdev(ramdisk_major, "ramdisk");
+			return PTR_ERR(dev);
+		}
+		ramdisk_add(dev);
+	}
+
+	return 0;
+}
+
+static void __exit exit_ramdisk(void)
+{
+	pr_emerg("Exiting RAMDISK!\n");
+	/*	Nobody can open a disk any more: the module is going	*/
+	ramdisk_destroy_all();
+	debugfs_remove_recursive(ramdisk_debugfs);
+	/*	Entries freed through RCU must be gone before the module text is	*/
+	rcu_barrier();
 	if (ramdisk_major > 0) {
 		unregister_blkdev(ramdisk_major, "ramdisk");
 	}
@@ -0,0 +1,17 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <linux/ioctl.h>
+
+/*
+ *	ioctls on /dev/ramdiskN, for CAP_SYS_ADMIN only. Can be included from
+ *	user space.
+ */
+#define RAMDISK_IOC_MAGIC	0xB7
+
+/*	Snapshot the disk: returns the index M of the new /dev/ramdiskM	*/
+#define RAMDISK_IOC_SNAPSHOT	_IO(RAMDISK_IOC_MAGIC, 1)
+/*	Remove the ramdisk whose index is passed as the argument; it must not be open	*/
+#define RAMDISK_IOC_DELETE	_IO(RAMDISK_IOC_MAGIC, 2)
+
+#endif
@@ -2,11 +2,518 @@
 #include <linux/init.h>
 #include <linux/slab.h>
 #include <linux/i2c.h>
+#include <linux/i2c-mux.h>
 #include <linux/delay.h>
 #include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include "toy_i2c.h"
 #define ADAPTER_NAME     "TOY_I2C_ADAPTER"
+
+/*
+** Simulated SCL frequency the bus starts with; 0 means transfers take no
+** bus time at all. Can be changed per adapter in its bus_speed_hz file.
+*/
+static unsigned int bus_speed_hz;
+module_param(bus_speed_hz, uint, 0444);
+MODULE_PARM_DESC(bus_speed_hz, "Simulated bus speed: 100000, 400000, 1000000, 3400000 or 0 = none (default: 0)");
+
+/*
+** Independent buses, each with its own lock; i2c-N of the first one is
+** printed at load time, the others follow
+*/
+#define TOY_MAX_ADAPTERS    16
+static unsigned int nr_adapters = 1;
+module_param(nr_adapters, uint, 0444);
+MODULE_PARM_DESC(nr_adapters, "Number of toy adapters, 1 to 16 (default: 1)");
+
+/*
+** PCA9548 style mux behind the first adapter: one more i2c-N per channel,
+** each with its own slaves but sharing the first adapter's wires and lock
+*/
+#define TOY_MAX_MUX_CHANNELS    8
+static unsigned int mux_channels;
+module_param(mux_channels, uint, 0444);
+MODULE_PARM_DESC(mux_channels, "Channels of a mux behind the first adapter, 0 to 8 (default: 0 = no mux)");
+
+static bool verbose;
+module_param(verbose, bool, 0644);
+MODULE_PARM_DESC(verbose, "Log every transfer and its data (default: off)");
+
+/*
+** 7 bit addresses only: the adapter does not advertise I2C_FUNC_10BIT_ADDR
+*/
+#define TOY_NR_ADDRS    0x80
+
+/*
+** Simulated slave devices
+** -    each one is a flat map of 8 bit registers with a register pointer
+** -    a write sets the pointer, further bytes go to the registers
+** -    reads start at the pointer; both auto-increment it
+** -    created and removed through the adapter's sim_new / sim_delete
+**      sysfs files
+*/
+struct toy_slave;
+
+struct toy_slave_model {
+    const char *name;
+    unsigned int nr_regs;
+    unsigned int page_size;     /* writes wrap inside a page, 0 = no pages */
+    void (*init)(struct toy_slave *slave);
+    /* Called before a read is served, sensors take a new sample here */
+    void (*read_start)(struct toy_slave *slave);
+    /* NULL when every register is writable */
+    bool (*writable)(unsigned int reg);
+    /* Registers that change on their own and must never be cached */
+    bool (*volatile_reg)(unsigned int reg);
+};
+
+struct toy_slave {
+    u16 addr;
+    const struct toy_slave_model *model;
+    unsigned int ptr;           /* register pointer */
+    u32 samples;                /* sensor: samples taken */
+
+    /*
+    ** Register cache, NULL while off; bus locked
+    ** -    byte and word data reads of cached registers skip the bus
+    ** -    every write to a register drops it from the cache
+    */
+    unsigned long *volatile_regs;
+    u8 *cache;
+    unsigned long *cached;
+    u64 cache_hits;
+    u64 cache_misses;
+    u64 cache_saved_ns;         /* bus time the hits did not take */
+    u8 regs[];
+};
+
+/*
+** The slaves wired to one bus segment: a toy adapter or a mux channel
+*/
+struct toy_segment {
+    struct toy_slave *slaves[TOY_NR_ADDRS];
+};
+
+/*
+** Transfer statistics
+** -    transfers, data bytes, NAKs and retries per slave address, plus the
+**      adapter totals; a retry is a transfer to an address whose previous
+**      transfer was NAKed
+** -    log2 histogram of the time spent in the adapter, in ns
+** -    kept per CPU, summed only when read from debugfs/toy_i2c/i2c-N/
+*/
+#define TOY_LAT_BUCKETS 32
+
+struct toy_xfer_stats {
+    u64 xfers;
+    u64 bytes;
+    u64 naks;
+    u64 retries;
+};
+
+struct toy_bus_pcpu {
+    struct toy_xfer_stats total;
+    struct toy_xfer_stats addr[TOY_NR_ADDRS];
+    u64 lat[TOY_LAT_BUCKETS];
+};
+
+/*
+** One simulated bus: the adapter and the slaves found at each address.
+** Slaves are added, removed and accessed with the bus locked; mux channel
+** adapters lock the bus they hang off.
+*/
+struct toy_bus {
+    struct i2c_adapter adapter;
+    struct toy_segment root;
+    struct i2c_mux_core *muxc;
+    struct toy_segment *chans;  /* one per mux channel */
+    int chan;                   /* selected mux channel, -1 = none */
+    unsigned int speed_hz;      /* simulated SCL frequency, 0 = no bus time */
+
+    struct toy_bus_pcpu __percpu *pcpu;
+    /* Last transfer to the address was NAKed; bus locked */
+    DECLARE_BITMAP(naked, TOY_NR_ADDRS);
+    struct dentry *debugfs;
+
+    /* Async engine: toy_i2c_submit queues, work drains in batches */
+    spinlock_t queue_lock;
+    struct list_head queue;
+    bool dying;
+    struct workqueue_struct *wq;
+    struct work_struct work;
+    bool in_batch;              /* bus locked: the worker is draining a batch */
+
+    /* Engine counters, only written by the worker */
+    u64 async_requests;
+    u64 async_batches;
+    u64 async_batch_max;
+    u64 queue_ns_total;         /* submit to start of transfer */
+    u64 queue_ns_max;
+    u64 busy_ns;                /* time the worker held the bus */
+};
+
+/*
+** 24C02 style EEPROM: 256 bytes, erased to 0xff, 8 byte write pages
+*/
+static void toy_eeprom_init(struct toy_slave *slave)
+{
+    memset(slave->regs, 0xff, slave->model->nr_regs);
+}
+
 /*
-** This function used to get the functionalities that are supported 
+** LM75 style temperature sensor
+** -    0x00/0x01: temperature, big endian, 1/256 degC; read only
+** -    0x0f: WHO_AM_I, read only
+** -    everything else is plain read/write configuration
+** The temperature ramps from 25 to 29 degC and back, one step per sample.
+*/
+#define TOY_SENSOR_TEMP         0x00
+#define TOY_SENSOR_WHO_AM_I     0x0f
+#define TOY_SENSOR_ID           0x75
+
+static void toy_sensor_init(struct toy_slave *slave)
+{
+    slave->regs[TOY_SENSOR_WHO_AM_I] = TOY_SENSOR_ID;
+}
+
+static void toy_sensor_sample(struct toy_slave *slave)
+{
+    u32 step = slave->samples++ % 128;
+    u16 temp = (25 << 8) + (step < 64 ? step : 128 - step) * 16;
+
+    slave->regs[TOY_SENSOR_TEMP] = temp >> 8;
+    slave->regs[TOY_SENSOR_TEMP + 1] = temp & 0xff;
+}
+
+static bool toy_sensor_writable(unsigned int reg)
+{
+    return reg > TOY_SENSOR_TEMP + 1 && reg != TOY_SENSOR_WHO_AM_I;
+}
+
+static bool toy_sensor_volatile(unsigned int reg)
+{
+    return TOY_SENSOR_TEMP == reg || TOY_SENSOR_TEMP + 1 == reg;
+}
+
+static const struct toy_slave_model toy_slave_models[] = {
+    {
+        .name       = "eeprom",
+        .nr_regs    = 256,
+        .page_size  = 8,
+        .init       = toy_eeprom_init,
+    },
+    {
+        .name       = "regs",
+        .nr_regs    = 256,
+    },
+    {
+        .name       = "sensor",
+        .nr_regs    = 256,
+        .init       = toy_sensor_init,
+        .read_start = toy_sensor_sample,
+        .writable   = toy_sensor_writable,
+        .volatile_reg = toy_sensor_volatile,
+    },
+};
+
+static struct toy_bus *toy_bus_of(struct i2c_adapter *adap)
+{
+    return i2c_get_adapdata(adap);
+}
+
+/*
+** Once selected, a mux channel stays connected: its slaves answer next to
+** the ones on the bus itself, and win if both sit at the same address.
+*/
+static struct toy_slave *toy_slave_find(struct toy_bus *bus, u16 addr)
+{
+    if (addr >= TOY_NR_ADDRS)
+        return NULL;
+    if (bus->chan >= 0 && bus->chans[bus->chan].slaves[addr])
+        return bus->chans[bus->chan].slaves[addr];
+    return bus->root.slaves[addr];
+}
+
+static void toy_slave_set_ptr(struct toy_slave *slave, unsigned int reg)
+{
+    slave->ptr = reg % slave->model->nr_regs;
+}
+
+static u8 toy_slave_read_byte(struct toy_slave *slave)
+{
+    u8 val = slave->regs[slave->ptr];
+
+    slave->ptr = (slave->ptr + 1) % slave->model->nr_regs;
+    return val;
+}
+
+static void toy_slave_write_byte(struct toy_slave *slave, u8 val)
+{
+    const struct toy_slave_model *model = slave->model;
+    unsigned int page = model->page_size;
+
+    if (NULL == model->writable || model->writable(slave->ptr))
+        slave->regs[slave->ptr] = val;
+    /* Write-through: the next read goes to the register */
+    if (slave->cache)
+        __clear_bit(slave->ptr, slave->cached);
+    if (page)
+        slave->ptr = (slave->ptr & ~(page - 1)) | ((slave->ptr + 1) & (page - 1));
+    else
+        slave->ptr = (slave->ptr + 1) % model->nr_regs;
+}
+
+static void toy_slave_read(struct toy_slave *slave, u8 *buf, unsigned int len)
+{
+    unsigned int i;
+
+    if (slave->model->read_start)
+        slave->model->read_start(slave);
+    for (i = 0; i < len; i++)
+        buf[i] = toy_slave_read_byte(slave);
+}
+
+static void toy_slave_cache_off(struct toy_slave *slave)
+{
+    kfree(slave->cache);
+    bitmap_free(slave->cached);
+    slave->cache = NULL;
+    slave->cached = NULL;
+}
+
+static void toy_slave_free(struct toy_slave *slave)
+{
+    if (NULL == slave)
+        return;
+    toy_slave_cache_off(slave);
+    bitmap_free(slave->volatile_regs);
+    kfree(slave);
+}
+
+static struct toy_slave *toy_slave_alloc(const struct toy_slave_model *model, u16 addr)
+{
+    struct toy_slave *slave;
+    unsigned int reg;
+
+    slave = kzalloc(sizeof(*slave) + model->nr_regs, GFP_KERNEL);
+    if (NULL == slave)
+        return NULL;
+    slave->volatile_regs = bitmap_zalloc(model->nr_regs, GFP_KERNEL);
+    if (NULL == slave->volatile_regs) {
+        kfree(slave);
+        return NULL;
+    }
+    slave->addr = addr;
+    slave->model = model;
+    for (reg = 0; model->volatile_reg && reg < model->nr_regs; reg++)
+        if (model->volatile_reg(reg))
+            __set_bit(reg, slave->volatile_regs);
+    if (model->init)
+        model->init(slave);
+    return slave;
+}
+
+/*
+** Bus timing model
+** -    every byte takes 9 SCL cycles (8 data bits and ACK)
+** -    a START, repeated START or STOP takes about one more
+** -    after a STOP the bus stays free for t_BUF before the next START;
+**      transactions the worker runs back to back in a batch chain with
+**      repeated STARTs and skip it
+*/
+static unsigned int toy_bus_free_ns(unsigned int hz)
+{
+    if (hz <= 100000)
+        return 4700;
+    if (hz <= 400000)
+        return 1300;
+    if (hz <= 1000000)
+        return 500;
+    return 160;
+}
+
+static u64 toy_bus_ns(struct toy_bus *bus, unsigned int bits)
+{
+    unsigned int hz = READ_ONCE(bus->speed_hz);
+    u64 ns;
+
+    if (0 == hz)
+        return 0;
+    ns = div_u64((u64)bits * NSEC_PER_SEC, hz);
+    if (!bus->in_batch)
+        ns += toy_bus_free_ns(hz);
+    return ns;
+}
+
+static void toy_bus_hold(struct toy_bus *bus, unsigned int bits)
+{
+    u64 ns = toy_bus_ns(bus, bits);
+
+    if (0 == ns)
+        return;
+    /* Short holds spin like a bit banging master would, long ones sleep */
+    if (ns < 10 * NSEC_PER_USEC)
+        ndelay(ns);
+    else
+        usleep_range(div_u64(ns, NSEC_PER_USEC), div_u64(ns, NSEC_PER_USEC) + 2);
+}
+
+/*
+** SCL cycles of an SMBus transaction: the address byte, the command and
+** data bytes, one START (two for reads with a command) and the STOP.
+*/
+static unsigned int toy_smbus_bits(int size, bool read, unsigned int len)
+{
+    unsigned int bytes = 1, starts = 1;
+
+    switch (size) {
+    case I2C_SMBUS_BYTE:
+        bytes += 1;
+        break;
+    case I2C_SMBUS_BYTE_DATA:
+        bytes += 2;
+        break;
+    case I2C_SMBUS_WORD_DATA:
+        bytes += 3;
+        break;
+    case I2C_SMBUS_BLOCK_DATA:
+        bytes += 2 + len;
+        break;
+    }
+    if (read && I2C_SMBUS_QUICK != size && I2C_SMBUS_BYTE != size) {
+        bytes++;
+        starts++;
+    }
+    return bytes * 9 + starts + 1;
+}
+
+/*
+** Register cache
+** -    only byte and word data reads are served from it: they name their
+**      register, the other reads start wherever the pointer is
+** -    a read that could have been cached but was not is a miss, and fills
+**      the cache on its way back
+** -    reads of volatile registers bypass the cache and count as neither
+*/
+static unsigned int toy_cache_len(int size)
+{
+    if (I2C_SMBUS_BYTE_DATA == size)
+        return 1;
+    if (I2C_SMBUS_WORD_DATA == size)
+        return 2;
+    return 0;
+}
+
+static bool toy_cache_usable(struct toy_slave *slave, u8 command, unsigned int len)
+{
+    unsigned int i;
+
+    if (NULL == slave || NULL == slave->cache || 0 == len)
+        return false;
+    for (i = 0; i < len; i++)
+        if (test_bit((command + i) % slave->model->nr_regs, slave->volatile_regs))
+            return false;
+    return true;
+}
+
+/*
+** Serve an SMBus read from the cache; false if it has to go to the bus.
+** A hit leaves the register pointer alone: the slave never sees it.
+*/
+static bool toy_cache_read(struct toy_bus *bus, u16 addr, char read_write,
+                           u8 command, int size, union i2c_smbus_data *data)
+{
+    struct toy_slave *slave;
+    unsigned int len = toy_cache_len(size), nr_regs, i;
+    u8 buf[2];
+
+    if (I2C_SMBUS_READ != read_write)
+        return false;
+    slave = toy_slave_find(bus, addr);
+    if (!toy_cache_usable(slave, command, len))
+        return false;
+    nr_regs = slave->model->nr_regs;
+    for (i = 0; i < len; i++) {
+        if (!test_bit((command + i) % nr_regs, slave->cached)) {
+            slave->cache_misses++;
+            return false;
+        }
+        buf[i] = slave->cache[(command + i) % nr_regs];
+    }
+    if (1 == len)
+        data->byte = buf[0];
+    else
+        data->word = buf[0] | (buf[1] << 8);
+    slave->cache_hits++;
+    slave->cache_saved_ns += toy_bus_ns(bus, toy_smbus_bits(size, true, 0));
+    return true;
+}
+
+/*
+** Keep what a read from the bus returned, starting at register command
+*/
+static void toy_cache_fill(struct toy_slave *slave, u8 command, const u8 *buf,
+                           unsigned int len)
+{
+    unsigned int nr_regs = slave->model->nr_regs, reg, i;
+
+    if (!toy_cache_usable(slave, command, len))
+        return;
+    for (i = 0; i < len; i++) {
+        reg = (command + i) % nr_regs;
+        slave->cache[reg] = buf[i];
+        __set_bit(reg, slave->cached);
+    }
+}
+
+/*
+** Count one transfer to addr that entered the adapter at start (ktime ns)
+** and ended with ret. Runs with the bus locked but only touches this CPU's
+** counters, so readers never hold up a transfer.
+*/
+static void toy_bus_account(struct toy_bus *bus, u16 addr, unsigned int bytes,
+                            int ret, u64 start)
+{
+    u64 ns = ktime_get_ns() - start;
+    unsigned int bucket = min_t(unsigned int, ilog2(ns | 1), TOY_LAT_BUCKETS - 1);
+    bool nak = -ENXIO == ret;
+    bool retry;
+
+    addr %= TOY_NR_ADDRS;
+    retry = test_bit(addr, bus->naked);
+    if (nak)
+        __set_bit(addr, bus->naked);
+    else if (retry)
+        __clear_bit(addr, bus->naked);
+
+    this_cpu_inc(bus->pcpu->total.xfers);
+    this_cpu_inc(bus->pcpu->addr[addr].xfers);
+    if (ret >= 0) {
+        this_cpu_add(bus->pcpu->total.bytes, bytes);
+        this_cpu_add(bus->pcpu->addr[addr].bytes, bytes);
+    }
+    if (nak) {
+        this_cpu_inc(bus->pcpu->total.naks);
+        this_cpu_inc(bus->pcpu->addr[addr].naks);
+    }
+    if (retry) {
+        this_cpu_inc(bus->pcpu->total.retries);
+        this_cpu_inc(bus->pcpu->addr[addr].retries);
+    }
+    this_cpu_inc(bus->pcpu->lat[bucket]);
+}
+
+/*
+** This function used to get the functionalities that are supported
 ** by this bus driver.
 */
 static u32 toy_func(struct i2c_adapter *adapter)
@@ -21,43 +528,200 @@ static u32 toy_func(struct i2c_adapter *adapter)
 /*
 ** This function will be called whenever you call I2C read, wirte APIs like
 ** i2c_master_send(), i2c_master_recv() etc.
+** An address nobody answers at NAKs the whole transfer with -ENXIO.
 */
-static s32 toy_i2c_xfer( struct i2c_adapter *adap, struct i2c_msg *msgs,int num )
+static s32 toy_i2c_do_xfer( struct i2c_adapter *adap, struct i2c_msg *msgs,int num )
 {
+    struct toy_bus *bus = toy_bus_of(adap);
+    unsigned int bits = 1;
     int i;
-    
+
     for(i = 0; i < num; i++)
     {
         int j;
         struct i2c_msg *msg_temp = &msgs[i];
-        
+        struct toy_slave *slave;
+
+        if (msg_temp->flags & I2C_M_TEN)
+            return -EOPNOTSUPP;
+        slave = toy_slave_find(bus, msg_temp->addr);
+        if (NULL == slave)
+        {
+            toy_bus_hold(bus, bits + 1 + 9 + 1);
+            return -ENXIO;
+        }
+
+        if (msg_temp->flags & I2C_M_RD)
+        {
+            if (msg_temp->flags & I2C_M_RECV_LEN)
+            {
+                /* SMBus block read: the first byte tells how many follow */
+                u8 count = min_t(unsigned int, I2C_SMBUS_BLOCK_MAX,
+                                 slave->model->nr_regs - slave->ptr);
+
+                msg_temp->buf[0] = count;
+                toy_slave_read(slave, &msg_temp->buf[1], count);
+                msg_temp->len += count;
+            }
+            else
+            {
+                toy_slave_read(slave, msg_temp->buf, msg_temp->len);
+            }
+        }
+        else if (msg_temp->len)
+        {
+            /* First byte written is the register pointer */
+            toy_slave_set_ptr(slave, msg_temp->buf[0]);
+            for (j = 1; j < msg_temp->len; j++)
+                toy_slave_write_byte(slave, msg_temp->buf[j]);
+        }
+
+        /* (repeated) START, address byte and data */
+        bits += 1 + 9 * (1 + msg_temp->len);
+
+        if (!verbose)
+            continue;
         pr_emerg("[Count: %d] [%s]: [Addr = 0x%x] [Len = %d] [Data] = ", i, __func__, msg_temp->addr, msg_temp->len);
-        
+
         for( j = 0; j < msg_temp->len; j++ )
         {
             pr_cont("[0x%02x] ", msg_temp->buf[j]);
         }
     }
-    return 0;
+    toy_bus_hold(bus, bits);
+    return num;
+}
+
+/*
+** The whole transfer is counted against the first message's address.
+*/
+static s32 toy_i2c_xfer( struct i2c_adapter *adap, struct i2c_msg *msgs,int num )
+{
+    u64 start = ktime_get_ns();
+    unsigned int bytes = 0;
+    int i, ret;
+
+    ret = toy_i2c_do_xfer(adap, msgs, num);
+    for (i = 0; ret >= 0 && i < num; i++)
+        bytes += msgs[i].len;
+    toy_bus_account(toy_bus_of(adap), num > 0 ? msgs[0].addr : 0, bytes, ret, start);
+    return ret;
 }
 /*
 ** This function will be called whenever you call SMBUS read, wirte APIs
+** Every protocol toy_func advertises is served from the slave's registers.
+** Word data is little endian: the low byte is at command.
 */
-static s32 toy_smbus_xfer(  struct i2c_adapter *adap, 
+static s32 toy_smbus_do_xfer(  struct i2c_adapter *adap,
                             u16 addr,
-                            unsigned short flags, 
+                            unsigned short flags,
                             char read_write,
-                            u8 command, 
-                            int size, 
+                            u8 command,
+                            int size,
                             union i2c_smbus_data *data
                          )
 {
-   	pr_info("In %s\n", __func__);
-	int i=0;
-	for (i=0; i<size; i++) {
-		pr_emerg("CMD:%d flags:%d size:%d addr:%d Data:%d RW:%c ", command, flags, size, addr, data->byte, read_write);
-	}
-	return 0;
+    struct toy_bus *bus = toy_bus_of(adap);
+    struct toy_slave *slave = toy_slave_find(bus, addr);
+    bool read = I2C_SMBUS_READ == read_write;
+    unsigned int i, len = 0;
+    u8 buf[2];
+
+    if (verbose)
+        pr_emerg("CMD:%d flags:%d size:%d addr:%d RW:%c\n", command, flags, size, addr, read ? 'R' : 'W');
+    if (NULL == slave) {
+        /* The address byte still went out before the NAK */
+        toy_bus_hold(bus, 9 + 2);
+        return -ENXIO;
+    }
+
+    switch (size) {
+    case I2C_SMBUS_QUICK:
+        break;
+    case I2C_SMBUS_BYTE:
+        /* A byte write only moves the pointer, a byte read reads at it */
+        if (read)
+            toy_slave_read(slave, &data->byte, 1);
+        else
+            toy_slave_set_ptr(slave, command);
+        break;
+    case I2C_SMBUS_BYTE_DATA:
+        toy_slave_set_ptr(slave, command);
+        if (read) {
+            toy_slave_read(slave, &data->byte, 1);
+            toy_cache_fill(slave, command, &data->byte, 1);
+        } else {
+            toy_slave_write_byte(slave, data->byte);
+        }
+        break;
+    case I2C_SMBUS_WORD_DATA:
+        toy_slave_set_ptr(slave, command);
+        if (read) {
+            toy_slave_read(slave, buf, 2);
+            toy_cache_fill(slave, command, buf, 2);
+            data->word = buf[0] | (buf[1] << 8);
+        } else {
+            toy_slave_write_byte(slave, data->word & 0xff);
+            toy_slave_write_byte(slave, data->word >> 8);
+        }
+        break;
+    case I2C_SMBUS_BLOCK_DATA:
+        toy_slave_set_ptr(slave, command);
+        if (read) {
+            /* As much as is left up to the end of the map, 32 at most */
+            len = min_t(unsigned int, I2C_SMBUS_BLOCK_MAX,
+                        slave->model->nr_regs - slave->ptr);
+            data->block[0] = len;
+            toy_slave_read(slave, &data->block[1], len);
+        } else {
+            len = data->block[0];
+            if (0 == len || len > I2C_SMBUS_BLOCK_MAX)
+                return -EINVAL;
+            for (i = 1; i <= len; i++)
+                toy_slave_write_byte(slave, data->block[i]);
+        }
+        break;
+    default:
+        return -EOPNOTSUPP;
+    }
+    toy_bus_hold(bus, toy_smbus_bits(size, read, len));
+    return 0;
+}
+
+static s32 toy_smbus_xfer(  struct i2c_adapter *adap,
+                            u16 addr,
+                            unsigned short flags,
+                            char read_write,
+                            u8 command,
+                            int size,
+                            union i2c_smbus_data *data
+                         )
+{
+    u64 start = ktime_get_ns();
+    unsigned int bytes = 0;
+    s32 ret;
+
+    /* A hit never reaches the bus, so it is not a transfer either */
+    if (toy_cache_read(toy_bus_of(adap), addr, read_write, command, size, data))
+        return 0;
+    ret = toy_smbus_do_xfer(adap, addr, flags, read_write, command, size, data);
+    /* Data bytes only, the command byte is not counted */
+    switch (size) {
+    case I2C_SMBUS_BYTE_DATA:
+        bytes = 1;
+        break;
+    case I2C_SMBUS_BYTE:
+        bytes = I2C_SMBUS_READ == read_write;
+        break;
+    case I2C_SMBUS_WORD_DATA:
+        bytes = 2;
+        break;
+    case I2C_SMBUS_BLOCK_DATA:
+        bytes = data->block[0];
+        break;
+    }
+    toy_bus_account(toy_bus_of(adap), addr, bytes, ret, start);
+    return ret;
 }
 /*
 ** I2C algorithm Structure
@@ -68,27 +732,625 @@ static struct i2c_algorithm toy_i2c_algorithm = {
     .functionality  = toy_func,
 };
 /*
-** I2C adapter Structure
+** The simulated buses
+*/
+static struct toy_bus **toy_buses;
+
+/*
+** Async engine
+** -    toy_i2c_submit() may be called from any context, by any number of
+**      clients; it only queues the request and kicks the worker
+** -    the worker takes everything queued so far as one batch and runs it
+**      with the bus locked once, back to back
+** -    completions run after the bus is unlocked, so they may submit again
+**      or even do a synchronous transfer
+*/
+static void toy_bus_work(struct work_struct *work)
+{
+    struct toy_bus *bus = container_of(work, struct toy_bus, work);
+    struct toy_i2c_req *req, *next;
+    LIST_HEAD(batch);
+    u64 nr = 0, ns;
+    ktime_t start;
+
+    spin_lock_irq(&bus->queue_lock);
+    list_splice_init(&bus->queue, &batch);
+    spin_unlock_irq(&bus->queue_lock);
+    if (list_empty(&batch))
+        return;
+
+    i2c_lock_bus(&bus->adapter, I2C_LOCK_SEGMENT);
+    start = ktime_get();
+    list_for_each_entry(req, &batch, node) {
+        ns = ktime_to_ns(ktime_sub(ktime_get(), req->queued));
+        bus->queue_ns_total += ns;
+        if (ns > bus->queue_ns_max)
+            bus->queue_ns_max = ns;
+        req->status = __i2c_transfer(&bus->adapter, req->msgs, req->num);
+        /* Whatever follows chains on with a repeated START */
+        bus->in_batch = true;
+        nr++;
+    }
+    bus->in_batch = false;
+    bus->busy_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+    i2c_unlock_bus(&bus->adapter, I2C_LOCK_SEGMENT);
+
+    bus->async_requests += nr;
+    bus->async_batches++;
+    if (nr > bus->async_batch_max)
+        bus->async_batch_max = nr;
+    list_for_each_entry_safe(req, next, &batch, node) {
+        list_del(&req->node);
+        req->complete(req);
+    }
+}
+
+int toy_i2c_submit(struct i2c_adapter *adap, struct toy_i2c_req *req)
+{
+    struct toy_bus *bus;
+    unsigned long flags;
+    int ret = 0;
+
+    if (adap->algo != &toy_i2c_algorithm || req->num <= 0 || NULL == req->complete)
+        return -EINVAL;
+    bus = toy_bus_of(adap);
+    req->queued = ktime_get();
+    spin_lock_irqsave(&bus->queue_lock, flags);
+    if (bus->dying)
+        ret = -ESHUTDOWN;
+    else
+        list_add_tail(&req->node, &bus->queue);
+    spin_unlock_irqrestore(&bus->queue_lock, flags);
+    if (0 == ret)
+        queue_work(bus->wq, &bus->work);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(toy_i2c_submit);
+
+static int toy_bus_engine_init(struct toy_bus *bus)
+{
+    spin_lock_init(&bus->queue_lock);
+    INIT_LIST_HEAD(&bus->queue);
+    INIT_WORK(&bus->work, toy_bus_work);
+    /* Ordered: one worker per bus, like one master driving it */
+    bus->wq = alloc_ordered_workqueue("toy_i2c_%s", WQ_MEM_RECLAIM, dev_name(&bus->adapter.dev));
+    return bus->wq ? 0 : -ENOMEM;
+}
+
+/*
+** Refuse new requests and complete the queued ones.
+*/
+static void toy_bus_engine_exit(struct toy_bus *bus)
+{
+    spin_lock_irq(&bus->queue_lock);
+    bus->dying = true;
+    spin_unlock_irq(&bus->queue_lock);
+    destroy_workqueue(bus->wq);
+}
+
+/*
+** sysfs on the adapter device (/sys/bus/i2c/devices/i2c-N/)
+** -    sim_new:    "<model> <addr>" adds a slave, e.g. "eeprom 0x50"
+** -    sim_delete: "<addr>" removes it
+** -    sim_slaves: lists the slaves, one "<addr> <model>" per line
+** -    sim_cache, sim_volatile: register cache, see below
+** -    the above on toy adapters and mux channels, what follows only on
+**      toy adapters
+*/
+static struct toy_segment *toy_segment_of(struct i2c_adapter *adap)
+{
+    struct i2c_adapter *root = i2c_root_adapter(&adap->dev);
+    struct toy_bus *bus = toy_bus_of(root);
+    int i;
+
+    if (root == adap)
+        return &bus->root;
+    for (i = 0; i < bus->muxc->num_adapters; i++)
+        if (bus->muxc->adapter[i] == adap)
+            return &bus->chans[i];
+    return NULL;
+}
+
+static ssize_t sim_new_store(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+    struct i2c_adapter *adap = to_i2c_adapter(dev);
+    struct toy_segment *seg = toy_segment_of(adap);
+    const struct toy_slave_model *model = NULL;
+    struct toy_slave *slave;
+    char name[16];
+    unsigned int addr;
+    int i, ret = 0;
+
+    if (2 != sscanf(buf, "%15s %i", name, &addr))
+        return -EINVAL;
+    /* Leave the reserved addresses alone, as i2c_check_7bit_addr_validity_strict does */
+    if (addr < 0x08 || addr > 0x77)
+        return -EINVAL;
+    for (i = 0; i < ARRAY_SIZE(toy_slave_models); i++)
+        if (0 == strcmp(name, toy_slave_models[i].name))
+            model = &toy_slave_models[i];
+    if (NULL == model)
+        return -EINVAL;
+
+    slave = toy_slave_alloc(model, addr);
+    if (NULL == slave)
+        return -ENOMEM;
+
+    i2c_lock_bus(adap, I2C_LOCK_SEGMENT);
+    if (seg->slaves[addr])
+        ret = -EBUSY;
+    else
+        seg->slaves[addr] = slave;
+    i2c_unlock_bus(adap, I2C_LOCK_SEGMENT);
+    if (ret) {
+        toy_slave_free(slave);
+        return ret;
+    }
+    return count;
+}
+static DEVICE_ATTR_WO(sim_new);
+
+static ssize_t sim_delete_store(struct device *dev, struct device_attribute *attr,
+                                const char *buf, size_t count)
+{
+    struct i2c_adapter *adap = to_i2c_adapter(dev);
+    struct toy_segment *seg = toy_segment_of(adap);
+    struct toy_slave *slave;
+    unsigned int addr;
+
+    if (kstrtouint(buf, 0, &addr) || addr >= TOY_NR_ADDRS)
+        return -EINVAL;
+    i2c_lock_bus(adap, I2C_LOCK_SEGMENT);
+    slave = seg->slaves[addr];
+    seg->slaves[addr] = NULL;
+    i2c_unlock_bus(adap, I2C_LOCK_SEGMENT);
+    if (NULL == slave)
+        return -ENOENT;
+    toy_slave_free(slave);
+    return count;
+}
+static DEVICE_ATTR_WO(sim_delete);
+
+static ssize_t sim_slaves_show(struct device *dev, struct device_attribute *attr,
+                               char *buf)
+{
+    struct i2c_adapter *adap = to_i2c_adapter(dev);
+    struct toy_segment *seg = toy_segment_of(adap);
+    ssize_t len = 0;
+    int addr;
+
+    i2c_lock_bus(adap, I2C_LOCK_SEGMENT);
+    for (addr = 0; addr < TOY_NR_ADDRS; addr++)
+        if (seg->slaves[addr])
+            len += scnprintf(buf + len, PAGE_SIZE - len, "0x%02x %s\n",
+                             addr, seg->slaves[addr]->model->name);
+    i2c_unlock_bus(adap, I2C_LOCK_SEGMENT);
+    return len;
+}
+static DEVICE_ATTR_RO(sim_slaves);
+
+/*
+** sim_cache
+** -    "<addr> on|off" turns the slave's register cache on or off
+** -    reads list the slaves with a cache: address, hits, misses and the
+**      bus time saved in ns at the current bus speed
 */
-static struct i2c_adapter toy_i2c_adapter = {
-    .owner  = THIS_MODULE,
-    .class  = I2C_CLASS_HWMON,//| I2C_CLASS_SPD,
-    .algo   = &toy_i2c_algorithm,
-    .name   = ADAPTER_NAME,
-    .nr     = -1	/*	Dynamically assign the bus number	*/
+static ssize_t sim_cache_store(struct device *dev, struct device_attribute *attr,
+                               const char *buf, size_t count)
+{
+    struct i2c_adapter *adap = to_i2c_adapter(dev);
+    struct toy_segment *seg = toy_segment_of(adap);
+    struct toy_slave *slave;
+    unsigned int addr, nr_regs;
+    u8 *cache = NULL;
+    unsigned long *cached = NULL;
+    char state[4];
+    bool on;
+    int ret = 0;
+
+    if (2 != sscanf(buf, "%i %3s", &addr, state) || addr >= TOY_NR_ADDRS ||
+        kstrtobool(state, &on))
+        return -EINVAL;
+
+    i2c_lock_bus(adap, I2C_LOCK_SEGMENT);
+    slave = seg->slaves[addr];
+    if (NULL == slave) {
+        ret = -ENOENT;
+    } else if (!on) {
+        toy_slave_cache_off(slave);
+    } else if (NULL == slave->cache) {
+        /* Allocated with the bus locked: the slave may go away otherwise */
+        nr_regs = slave->model->nr_regs;
+        cache = kzalloc(nr_regs, GFP_KERNEL);
+        cached = bitmap_zalloc(nr_regs, GFP_KERNEL);
+        if (cache && cached) {
+            slave->cache = cache;
+            slave->cached = cached;
+            slave->cache_hits = slave->cache_misses = slave->cache_saved_ns = 0;
+        } else {
+            kfree(cache);
+            bitmap_free(cached);
+            ret = -ENOMEM;
+        }
+    }
+    i2c_unlock_bus(adap, I2C_LOCK_SEGMENT);
+    return ret ? ret : count;
+}
+
+static ssize_t sim_cache_show(struct device *dev, struct device_attribute *attr,
+                              char *buf)
+{
+    struct i2c_adapter *adap = to_i2c_adapter(dev);
+    struct toy_segment *seg = toy_segment_of(adap);
+    struct toy_slave *slave;
+    ssize_t len = 0;
+    int addr;
+
+    i2c_lock_bus(adap, I2C_LOCK_SEGMENT);
+    for (addr = 0; addr < TOY_NR_ADDRS; addr++) {
+        slave = seg->slaves[addr];
+        if (slave && slave->cache)
+            len += scnprintf(buf + len, PAGE_SIZE - len, "0x%02x %llu %llu %llu\n",
+                             addr, slave->cache_hits, slave->cache_misses,
+                             slave->cache_saved_ns);
+    }
+    i2c_unlock_bus(adap, I2C_LOCK_SEGMENT);
+    return len;
+}
+static DEVICE_ATTR_RW(sim_cache);
+
+/*
+** sim_volatile: "<addr> <reg> 1" marks a register volatile, so it is never
+** cached, "<addr> <reg> 0" lets it be cached again. Models start with
+** their own choice, e.g. the sensor's temperature.
+*/
+static ssize_t sim_volatile_store(struct device *dev, struct device_attribute *attr,
+                                  const char *buf, size_t count)
+{
+    struct i2c_adapter *adap = to_i2c_adapter(dev);
+    struct toy_segment *seg = toy_segment_of(adap);
+    struct toy_slave *slave;
+    unsigned int addr, reg, on;
+    int ret = 0;
+
+    if (3 != sscanf(buf, "%i %i %u", &addr, &reg, &on) || addr >= TOY_NR_ADDRS || on > 1)
+        return -EINVAL;
+
+    i2c_lock_bus(adap, I2C_LOCK_SEGMENT);
+    slave = seg->slaves[addr];
+    if (NULL == slave || reg >= slave->model->nr_regs) {
+        ret = slave ? -EINVAL : -ENOENT;
+    } else if (on) {
+        __set_bit(reg, slave->volatile_regs);
+        if (slave->cache)
+            __clear_bit(reg, slave->cached);
+    } else {
+        __clear_bit(reg, slave->volatile_regs);
+    }
+    i2c_unlock_bus(adap, I2C_LOCK_SEGMENT);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_WO(sim_volatile);
+
+static struct attribute *toy_segment_attrs[] = {
+    &dev_attr_sim_new.attr,
+    &dev_attr_sim_delete.attr,
+    &dev_attr_sim_slaves.attr,
+    &dev_attr_sim_cache.attr,
+    &dev_attr_sim_volatile.attr,
+    NULL,
 };
 
+static const struct attribute_group toy_segment_group = {
+    .attrs = toy_segment_attrs,
+};
+
+static ssize_t bus_speed_hz_show(struct device *dev, struct device_attribute *attr,
+                                 char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(toy_bus_of(to_i2c_adapter(dev))->speed_hz));
+}
+
+static ssize_t bus_speed_hz_store(struct device *dev, struct device_attribute *attr,
+                                  const char *buf, size_t count)
+{
+    unsigned int hz;
+
+    if (kstrtouint(buf, 0, &hz) || hz > 3400000)
+        return -EINVAL;
+    WRITE_ONCE(toy_bus_of(to_i2c_adapter(dev))->speed_hz, hz);
+    return count;
+}
+static DEVICE_ATTR_RW(bus_speed_hz);
+
+/*
+** Async engine counters: requests, batches, largest batch, average and
+** worst time spent queued in ns, then the time spent on the bus in ns;
+** requests over bus time is the throughput
+*/
+static ssize_t async_stats_show(struct device *dev, struct device_attribute *attr,
+                                char *buf)
+{
+    struct toy_bus *bus = toy_bus_of(to_i2c_adapter(dev));
+    u64 requests = READ_ONCE(bus->async_requests);
+
+    return sprintf(buf, "%llu %llu %llu %llu %llu %llu\n", requests,
+                   READ_ONCE(bus->async_batches), READ_ONCE(bus->async_batch_max),
+                   requests ? div64_u64(READ_ONCE(bus->queue_ns_total), requests) : 0,
+                   READ_ONCE(bus->queue_ns_max), READ_ONCE(bus->busy_ns));
+}
+static DEVICE_ATTR_RO(async_stats);
+
+static struct attribute *toy_bus_attrs[] = {
+    &dev_attr_bus_speed_hz.attr,
+    &dev_attr_async_stats.attr,
+    NULL,
+};
+
+static const struct attribute_group toy_bus_group = {
+    .attrs = toy_bus_attrs,
+};
+
+static const struct attribute_group *toy_bus_groups[] = {
+    &toy_segment_group,
+    &toy_bus_group,
+    NULL,
+};
+
+/*
+** debugfs (/sys/kernel/debug/toy_i2c/i2c-N/)
+** -    stats: adapter totals, then one line per address that saw traffic
+** -    latency: transfer duration histogram
+*/
+static struct dentry *toy_i2c_debugfs;
+
+static void toy_stats_sum(struct toy_xfer_stats *sum, const struct toy_xfer_stats *pc)
+{
+    sum->xfers += pc->xfers;
+    sum->bytes += pc->bytes;
+    sum->naks += pc->naks;
+    sum->retries += pc->retries;
+}
+
+static void toy_stats_line(struct seq_file *m, const char *name, const struct toy_xfer_stats *st)
+{
+    seq_printf(m, "%-6s %16llu %20llu %12llu %12llu\n", name,
+               st->xfers, st->bytes, st->naks, st->retries);
+}
+
+static int toy_stats_show(struct seq_file *m, void *v)
+{
+    struct toy_bus *bus = m->private;
+    struct toy_xfer_stats st;
+    char name[8];
+    int addr, cpu;
+
+    seq_printf(m, "%-6s %16s %20s %12s %12s\n", "", "xfers", "bytes", "naks", "retries");
+    memset(&st, 0, sizeof(st));
+    for_each_possible_cpu(cpu)
+        toy_stats_sum(&st, &per_cpu_ptr(bus->pcpu, cpu)->total);
+    toy_stats_line(m, "total", &st);
+    for (addr = 0; addr < TOY_NR_ADDRS; addr++) {
+        memset(&st, 0, sizeof(st));
+        for_each_possible_cpu(cpu)
+            toy_stats_sum(&st, &per_cpu_ptr(bus->pcpu, cpu)->addr[addr]);
+        if (0 == st.xfers)
+            continue;
+        snprintf(name, sizeof(name), "0x%02x", addr);
+        toy_stats_line(m, name, &st);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(toy_stats);
+
+/*
+** One line per non empty bucket: lower bound of the bucket in ns, then
+** the count.
+*/
+static int toy_latency_show(struct seq_file *m, void *v)
+{
+    struct toy_bus *bus = m->private;
+    u64 hist[TOY_LAT_BUCKETS] = {};
+    int cpu, b;
+
+    for_each_possible_cpu(cpu) {
+        for (b = 0; b < TOY_LAT_BUCKETS; b++)
+            hist[b] += per_cpu_ptr(bus->pcpu, cpu)->lat[b];
+    }
+    for (b = 0; b < TOY_LAT_BUCKETS; b++) {
+        if (hist[b])
+            seq_printf(m, "%12llu %16llu\n", 1ULL << b, hist[b]);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(toy_latency);
+
+static void toy_bus_debugfs_add(struct toy_bus *bus)
+{
+    bus->debugfs = debugfs_create_dir(dev_name(&bus->adapter.dev), toy_i2c_debugfs);
+    debugfs_create_file("stats", 0444, bus->debugfs, bus, &toy_stats_fops);
+    debugfs_create_file("latency", 0444, bus->debugfs, bus, &toy_latency_fops);
+}
+
+/*
+** Mux
+** -    parent locked: a transfer on a channel holds the bus it hangs off
+**      for the channel switch and the transfer both
+** -    switching channels costs a one byte write to the mux; the channel
+**      stays selected afterwards, as on a PCA9548 with idle state "as is"
+*/
+static int toy_mux_select(struct i2c_mux_core *muxc, u32 chan)
+{
+    struct toy_bus *bus = i2c_mux_priv(muxc);
+
+    if (bus->chan != (int)chan) {
+        bus->chan = chan;
+        toy_bus_hold(bus, 1 + 9 * 2 + 1);
+    }
+    return 0;
+}
+
+static int toy_bus_add_mux(struct toy_bus *bus, unsigned int nr)
+{
+    struct i2c_mux_core *muxc;
+    int i, ret;
+
+    bus->chans = kcalloc(nr, sizeof(*bus->chans), GFP_KERNEL);
+    if (NULL == bus->chans)
+        return -ENOMEM;
+    muxc = i2c_mux_alloc(&bus->adapter, &bus->adapter.dev, nr, 0, 0,
+                         toy_mux_select, NULL);
+    if (NULL == muxc)
+        return -ENOMEM;
+    muxc->priv = bus;
+    bus->muxc = muxc;
+    for (i = 0; i < nr; i++) {
+        ret = i2c_mux_add_adapter(muxc, 0, i, 0);
+        if (0 == ret)
+            ret = sysfs_create_group(&muxc->adapter[i]->dev.kobj, &toy_segment_group);
+        if (ret) {
+            i2c_mux_del_adapters(muxc);
+            bus->muxc = NULL;
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static void toy_bus_free_segment(struct toy_segment *seg)
+{
+    int addr;
+
+    for (addr = 0; addr < TOY_NR_ADDRS; addr++) {
+        toy_slave_free(seg->slaves[addr]);
+        seg->slaves[addr] = NULL;
+    }
+}
+
+static void toy_bus_free_slaves(struct toy_bus *bus)
+{
+    int i;
+
+    toy_bus_free_segment(&bus->root);
+    for (i = 0; bus->chans && i < mux_channels; i++)
+        toy_bus_free_segment(&bus->chans[i]);
+    kfree(bus->chans);
+    bus->chans = NULL;
+}
+
+/*
+** Register toy adapter number id. The first one is called ADAPTER_NAME,
+** the others get -id appended.
+*/
+static struct toy_bus *toy_bus_create(unsigned int id)
+{
+    struct toy_bus *bus;
+    int ret;
+
+    bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+    if (NULL == bus)
+        return ERR_PTR(-ENOMEM);
+    bus->adapter.owner = THIS_MODULE;
+    bus->adapter.class = I2C_CLASS_HWMON;//| I2C_CLASS_SPD
+    bus->adapter.algo = &toy_i2c_algorithm;
+    bus->adapter.nr = -1;	/*	Dynamically assign the bus number	*/
+    if (0 == id)
+        strscpy(bus->adapter.name, ADAPTER_NAME, sizeof(bus->adapter.name));
+    else
+        snprintf(bus->adapter.name, sizeof(bus->adapter.name), ADAPTER_NAME "-%u", id);
+    bus->adapter.dev.groups = toy_bus_groups;
+    bus->speed_hz = bus_speed_hz;
+    bus->chan = -1;
+    bus->pcpu = alloc_percpu(struct toy_bus_pcpu);
+    if (NULL == bus->pcpu) {
+        ret = -ENOMEM;
+        goto free_bus;
+    }
+    i2c_set_adapdata(&bus->adapter, bus);
+    ret = i2c_add_numbered_adapter(&bus->adapter);
+    if (ret) {
+        pr_emerg("fetching bus number failed");
+        goto free_pcpu;
+    }
+    ret = toy_bus_engine_init(bus);
+    if (ret) {
+        i2c_del_adapter(&bus->adapter);
+        goto free_pcpu;
+    }
+    toy_bus_debugfs_add(bus);
+    return bus;
+
+free_pcpu:
+    free_percpu(bus->pcpu);
+free_bus:
+    kfree(bus);
+    return ERR_PTR(ret);
+}
+
+static void toy_bus_destroy(struct toy_bus *bus)
+{
+    debugfs_remove_recursive(bus->debugfs);
+    if (bus->muxc)
+        i2c_mux_del_adapters(bus->muxc);
+    toy_bus_engine_exit(bus);
+    i2c_del_adapter(&bus->adapter);
+    free_percpu(bus->pcpu);
+    toy_bus_free_slaves(bus);
+    kfree(bus);
+}
+
+static void toy_buses_destroy(unsigned int nr)
+{
+    while (nr--)
+        toy_bus_destroy(toy_buses[nr]);
+    kfree(toy_buses);
+}
+
 static int __init toy_i2c_bus_driver_init(void) {
+	struct toy_bus *bus;
+	unsigned int i;
 	int ret = -1;
-	ret = i2c_add_numbered_adapter(&toy_i2c_adapter);
-	if (ret) pr_emerg("fetching bus number failed");
-	pr_emerg("Adapter number:%d\n", toy_i2c_adapter.nr);
+	if (bus_speed_hz > 3400000) {
+		pr_emerg("bus_speed_hz must not exceed 3400000\n");
+		return -EINVAL;
+	}
+	if (0 == nr_adapters || nr_adapters > TOY_MAX_ADAPTERS ||
+	    mux_channels > TOY_MAX_MUX_CHANNELS) {
+		pr_emerg("nr_adapters must be 1 to 16, mux_channels 0 to 8\n");
+		return -EINVAL;
+	}
+	toy_buses = kcalloc(nr_adapters, sizeof(*toy_buses), GFP_KERNEL);
+	if (NULL == toy_buses)
+		return -ENOMEM;
+	/* Statistics are a debugging aid: the buses work without debugfs */
+	toy_i2c_debugfs = debugfs_create_dir("toy_i2c", NULL);
+	for (i = 0; i < nr_adapters; i++) {
+		bus = toy_bus_create(i);
+		if (IS_ERR(bus)) {
+			ret = PTR_ERR(bus);
+			goto fail;
+		}
+		toy_buses[i] = bus;
+		pr_emerg("Adapter number:%d\n", bus->adapter.nr);
+	}
+	if (mux_channels) {
+		ret = toy_bus_add_mux(toy_buses[0], mux_channels);
+		if (ret)
+			goto fail;
+	}
 	return 0;
+
+fail:
+	toy_buses_destroy(i);
+	debugfs_remove_recursive(toy_i2c_debugfs);
+	return ret;
 }
 
 static void __exit toy_i2c_bus_driver_exit(void)
 {
-    i2c_del_adapter(&toy_i2c_adapter);
+    toy_buses_destroy(nr_adapters);
+    debugfs_remove_recursive(toy_i2c_debugfs);
     pr_emerg("Bus Driver Removed!!!\n");
 }
 
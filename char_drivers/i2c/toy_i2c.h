@@ -0,0 +1,29 @@
+#ifndef TOY_I2C_H
+#define TOY_I2C_H
+
+#include <linux/i2c.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+
+/*
+** Asynchronous transfer on a toy adapter. Fill in msgs, num and complete,
+** then hand the request to toy_i2c_submit(). complete() is called from
+** the adapter's worker, in process context and without the bus locked,
+** with status set to the number of messages transferred or a -errno.
+** msgs and the request must stay around until then.
+*/
+struct toy_i2c_req {
+    struct i2c_msg *msgs;
+    int num;
+    void (*complete)(struct toy_i2c_req *req);
+    void *context;
+    int status;
+
+    /* Private to the adapter */
+    struct list_head node;
+    ktime_t queued;
+};
+
+int toy_i2c_submit(struct i2c_adapter *adap, struct toy_i2c_req *req);
+
+#endif
@@ -2,10 +2,27 @@
 #include <linux/kernel.h>
 #include <linux/printk.h>
 #include <linux/interrupt.h>	/*	IRQ routines		*/
-#include <asm/io.h>		/*	To use asm		*/
 #include <linux/kobject.h>	/*	To use kernel objs	*/
 #include <linux/sysfs.h>	/*	routines to add sysfs nodes	*/
 #include <linux/device.h>
+#include <linux/hrtimer.h>	/*	softirq context bottom half	*/
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/irq.h>		/*	dummy_irq_chip, handle_simple_irq	*/
+#include <linux/irqdomain.h>	/*	virtual IRQs			*/
+#include <linux/irq_work.h>
+#include <linux/cpumask.h>
+#include <linux/mutex.h>
+#include <linux/smp.h>
+#include <linux/sched/clock.h>	/*	local_clock		*/
+#include <linux/cpu.h>
+#include <linux/math64.h>
+#include <linux/kfifo.h>
+#include <linux/spinlock.h>
+#include <linux/kthread.h>
 
 #ifdef VSDBG
         #define CALL(expr)                              (expr)
@@ -19,12 +36,1020 @@
         #define PS(string)
 #endif
 
-/*	Works only for intel x86 arch	*/
-#define IRQ_NUM1	11
-#define IRQ_NUM2	13
-#define IRQ_NUM3	10
-#define START_VECTOR_ADDR	(0x20 + 0x10)
-#define IRQ_VECTOR_ADDR(irq)	(START_VECTOR_ADDR + irq)
+/*	Periodic events: at most this many per second per IRQ	*/
+#define EVENT_RATE_MAX	100000
+
+static unsigned int event_rate;
+module_param(event_rate, uint, 0444);
+MODULE_PARM_DESC(event_rate, "Events per second raised on each IRQ at load, 0 = only on demand (default: 0)");
+
+static unsigned int event_cpu;
+module_param(event_cpu, uint, 0444);
+MODULE_PARM_DESC(event_cpu, "CPU the events are raised on at load (default: 0)");
+
+static unsigned int ring_depth = 256;
+module_param(ring_depth, uint, 0444);
+MODULE_PARM_DESC(ring_depth, "Events each top half to bottom half queue holds, a power of 2 from 2 to 65536 (default: 256)");
+
+static char *wq_backend = "system";
+module_param(wq_backend, charp, 0444);
+MODULE_PARM_DESC(wq_backend, "Deferral for the work queue IRQ at load: system, threaded, bound, bound_highpri, unbound, unbound_highpri or kthread (default: system)");
+
+static unsigned int backend_cpu;
+module_param(backend_cpu, uint, 0444);
+MODULE_PARM_DESC(backend_cpu, "CPU the kthread back-end's worker is pinned to (default: 0)");
+
+/*======================================================================================================
+ *					LATENCY HISTOGRAMS
+ *					-	top half to bottom half delay, in ns
+ *					-	log2 buckets split in LAT_SUB linear steps, so a percentile
+ *						is known to within 1/LAT_SUB of its value
+ *					-	per CPU, summed when read from sysfs
+ *======================================================================================================
+ */
+#define LAT_SUB_BITS	3
+#define LAT_SUB		(1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS	36	/*	~68s, slower ones land in the last bucket	*/
+#define LAT_BUCKETS	((LAT_MAX_BITS - LAT_SUB_BITS + 2) * LAT_SUB)
+
+struct lat_pcpu {
+	u64 count;
+	u64 min;
+	u64 max;
+	u64 hist[LAT_BUCKETS];
+};
+
+static unsigned int lat_bucket(u64 ns)
+{
+	unsigned int order;
+
+	if (ns < LAT_SUB)
+		return ns;
+	order = ilog2(ns);
+	if (order > LAT_MAX_BITS)
+		return LAT_BUCKETS - 1;
+	return (order - LAT_SUB_BITS + 1) * LAT_SUB + ((ns >> (order - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+/*
+ *	Smallest value of a bucket
+ */
+static u64 lat_bucket_ns(unsigned int bucket)
+{
+	unsigned int order;
+
+	if (bucket < LAT_SUB)
+		return bucket;
+	order = bucket / LAT_SUB + LAT_SUB_BITS - 1;
+	return (1ULL << order) | ((u64)(bucket % LAT_SUB) << (order - LAT_SUB_BITS));
+}
+
+/*
+ *	Called from the bottom half: no other bottom half of the same kind
+ *	runs on this CPU meanwhile, and preemption is off while it updates.
+ */
+static void lat_record(struct lat_pcpu __percpu *lat, u64 ns)
+{
+	struct lat_pcpu *pc = get_cpu_ptr(lat);
+
+	if (0 == pc->count || ns < pc->min)
+		pc->min = ns;
+	if (ns > pc->max)
+		pc->max = ns;
+	pc->count++;
+	pc->hist[lat_bucket(ns)]++;
+	put_cpu_ptr(lat);
+}
+
+/*
+ *	"count min p50 p99 max", all but count in ns.
+ */
+static ssize_t lat_show(struct lat_pcpu __percpu *lat, char *buf)
+{
+	u64 count = 0, min = U64_MAX, max = 0, seen = 0, p50 = 0, p99 = 0;
+	struct lat_pcpu *pc;
+	u64 *hist;
+	int cpu, b;
+
+	hist = kcalloc(LAT_BUCKETS, sizeof(*hist), GFP_KERNEL);
+	if (NULL == hist)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(lat, cpu);
+		if (0 == pc->count)
+			continue;
+		count += pc->count;
+		min = min(min, pc->min);
+		max = max(max, pc->max);
+		for (b = 0; b < LAT_BUCKETS; b++)
+			hist[b] += pc->hist[b];
+	}
+	for (b = 0; b < LAT_BUCKETS && count; b++) {
+		if (seen < DIV_ROUND_UP(count * 50, 100) && seen + hist[b] >= DIV_ROUND_UP(count * 50, 100))
+			p50 = lat_bucket_ns(b);
+		if (seen < DIV_ROUND_UP(count * 99, 100) && seen + hist[b] >= DIV_ROUND_UP(count * 99, 100))
+			p99 = lat_bucket_ns(b);
+		seen += hist[b];
+	}
+	kfree(hist);
+	return sprintf(buf, "%llu %llu %llu %llu %llu\n", count, count ? min : 0, p50, p99, max);
+}
+
+/*======================================================================================================
+ *					EVENT QUEUES: top half to bottom half
+ *					-	ring: one single producer, single consumer ring per CPU and
+ *						bottom half; the top half on that CPU pushes, the bottom half,
+ *						which never runs twice at once, drains every CPU's ring.
+ *						No locks, no atomics: head and tail are published with
+ *						release/acquire
+ *					-	kfifo: one kfifo per bottom half shared by every CPU under a
+ *						spinlock, to compare against
+ *					-	event_queue picks where top halves push; bottom halves drain
+ *						both, so it can be switched at any time
+ *					-	a full queue drops the event and counts an overflow
+ *======================================================================================================
+ */
+enum {
+	QUEUE_RING,
+	QUEUE_KFIFO,
+	QUEUE_NR,
+};
+
+static const char * const queue_names[QUEUE_NR] = {
+	[QUEUE_RING]	= "ring",
+	[QUEUE_KFIFO]	= "kfifo",
+};
+
+static unsigned int event_queue = QUEUE_RING;
+
+#define BATCH_BUCKETS	17	/*	log2 of events per drain, up to 65536	*/
+
+struct ev_record {
+	u64 stamp;		/*	ktime ns, taken in the top half	*/
+	u32 cpu;
+	u32 seq;
+};
+
+struct ev_ring {
+	unsigned int head;	/*	written by the top half	*/
+	unsigned int tail;	/*	written by the bottom half	*/
+	unsigned int hiwat;	/*	most events ever queued	*/
+	u32 seq;
+	struct ev_record *recs;
+};
+
+struct queue_pcpu {
+	u64 pushes;		/*	top half side, on this CPU	*/
+	u64 overflows;
+	u64 push_ns;
+	u64 drains;		/*	bottom half side, on this CPU	*/
+	u64 pops;
+	u64 pop_ns;
+	u64 batch[BATCH_BUCKETS];
+};
+
+/*======================================================================================================
+ *					BOTTOM HALVES
+ *					-	softirq: a module can't add a softirq vector, so an
+ *						hrtimer in soft mode, expiring at once, stands in for
+ *						one: it runs from HRTIMER_SOFTIRQ
+ *					-	tasklet
+ *					-	work queue, on the system wq
+ *					-	every run drains all queued events, see above, and records
+ *						each one's top to bottom latency
+ *======================================================================================================
+ */
+enum {
+	BH_SOFTIRQ,
+	BH_TASKLET,
+	BH_WORKQUEUE,
+	BH_NR,
+};
+
+struct bottom_half {
+	struct ev_ring __percpu *rings;
+	spinlock_t fifo_lock;
+	DECLARE_KFIFO_PTR(fifo, struct ev_record);
+	unsigned int fifo_hiwat;
+	struct queue_pcpu __percpu *qstat;
+	struct lat_pcpu __percpu *lat;
+	union {
+		struct hrtimer timer;
+		struct tasklet_struct tasklet;
+		struct work_struct work;
+	};
+};
+
+static struct bottom_half bhs[BH_NR];
+
+/*
+ *	Top half: hard irq context, so nothing else pushes on this CPU meanwhile.
+ */
+static void ev_push(struct bottom_half *bh)
+{
+	struct queue_pcpu *qs = this_cpu_ptr(bh->qstat);
+	struct ev_ring *ring = this_cpu_ptr(bh->rings);
+	u64 start = local_clock();
+	struct ev_record rec = {
+		.stamp	= ktime_get_ns(),
+		.cpu	= smp_processor_id(),
+		.seq	= ring->seq++,
+	};
+	unsigned int head, used;
+	bool full;
+
+	if (QUEUE_KFIFO == READ_ONCE(event_queue)) {
+		spin_lock(&bh->fifo_lock);
+		full = !kfifo_put(&bh->fifo, rec);
+		used = kfifo_len(&bh->fifo);
+		if (used > bh->fifo_hiwat)
+			bh->fifo_hiwat = used;
+		spin_unlock(&bh->fifo_lock);
+	} else {
+		head = ring->head;
+		used = head - smp_load_acquire(&ring->tail);
+		full = used >= ring_depth;
+		if (!full) {
+			ring->recs[head & (ring_depth - 1)] = rec;
+			/*	The record must be visible before the new head	*/
+			smp_store_release(&ring->head, head + 1);
+			if (used + 1 > ring->hiwat)
+				ring->hiwat = used + 1;
+		}
+	}
+	qs->pushes++;
+	if (full)
+		qs->overflows++;
+	qs->push_ns += local_clock() - start;
+}
+
+/*
+ *	Bottom half: drain every CPU's ring and the kfifo in one batch.
+ *	Returns the events drained; *migrated counts those raised on another
+ *	CPU than the one draining them.
+ */
+static unsigned int ev_drain(struct bottom_half *bh, unsigned int *migrated)
+{
+	unsigned int here = raw_smp_processor_id(), moved = 0;
+	u64 start = local_clock(), now = ktime_get_ns();
+	struct queue_pcpu *qs;
+	struct ev_ring *ring;
+	struct ev_record rec;
+	unsigned int head, tail, n = 0;
+	unsigned long flags;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(bh->rings, cpu);
+		tail = ring->tail;
+		head = smp_load_acquire(&ring->head);
+		if (cpu != here)
+			moved += head - tail;
+		for (; tail != head; tail++, n++)
+			lat_record(bh->lat, now - ring->recs[tail & (ring_depth - 1)].stamp);
+		/*	Done reading the records before the top half may reuse them	*/
+		smp_store_release(&ring->tail, tail);
+	}
+	for (;;) {
+		spin_lock_irqsave(&bh->fifo_lock, flags);
+		if (!kfifo_get(&bh->fifo, &rec)) {
+			spin_unlock_irqrestore(&bh->fifo_lock, flags);
+			break;
+		}
+		spin_unlock_irqrestore(&bh->fifo_lock, flags);
+		lat_record(bh->lat, now - rec.stamp);
+		moved += rec.cpu != here;
+		n++;
+	}
+	if (migrated)
+		*migrated = moved;
+	if (0 == n)
+		return 0;
+	qs = get_cpu_ptr(bh->qstat);
+	qs->drains++;
+	qs->pops += n;
+	qs->batch[min_t(unsigned int, ilog2(n), BATCH_BUCKETS - 1)]++;
+	qs->pop_ns += local_clock() - start;
+	put_cpu_ptr(bh->qstat);
+	return n;
+}
+
+/*
+ *	"<bh> pushes overflows hiwat push_ns/event pops pop_ns/event drains"
+ *	per bottom half; hiwat is the fullest any one queue got.
+ */
+static ssize_t queue_stats_show_all(char *buf)
+{
+	static const char * const names[BH_NR] = { "softirq", "tasklet", "workqueue" };
+	struct queue_pcpu sum, *qs;
+	unsigned int hiwat;
+	ssize_t len = 0;
+	int i, cpu;
+
+	for (i = 0; i < BH_NR; i++) {
+		memset(&sum, 0, sizeof(sum));
+		hiwat = READ_ONCE(bhs[i].fifo_hiwat);
+		for_each_possible_cpu(cpu) {
+			qs = per_cpu_ptr(bhs[i].qstat, cpu);
+			sum.pushes += qs->pushes;
+			sum.overflows += qs->overflows;
+			sum.push_ns += qs->push_ns;
+			sum.pops += qs->pops;
+			sum.pop_ns += qs->pop_ns;
+			sum.drains += qs->drains;
+			hiwat = max(hiwat, READ_ONCE(per_cpu_ptr(bhs[i].rings, cpu)->hiwat));
+		}
+		len += sprintf(buf + len, "%-9s %llu %llu %u %llu %llu %llu %llu\n", names[i],
+			       sum.pushes, sum.overflows, hiwat,
+			       sum.pushes ? div64_u64(sum.push_ns, sum.pushes) : 0, sum.pops,
+			       sum.pops ? div64_u64(sum.pop_ns, sum.pops) : 0, sum.drains);
+	}
+	return len;
+}
+
+/*
+ *	Per bottom half, drains by events drained: bucket b counts the drains
+ *	of 2^b to 2^(b+1) - 1 events.
+ */
+static ssize_t batch_sizes_show_all(char *buf)
+{
+	static const char * const names[BH_NR] = { "softirq", "tasklet", "workqueue" };
+	u64 hist[BATCH_BUCKETS];
+	ssize_t len = 0;
+	int i, b, cpu;
+
+	for (i = 0; i < BH_NR; i++) {
+		memset(hist, 0, sizeof(hist));
+		for_each_possible_cpu(cpu)
+			for (b = 0; b < BATCH_BUCKETS; b++)
+				hist[b] += per_cpu_ptr(bhs[i].qstat, cpu)->batch[b];
+		len += sprintf(buf + len, "%-9s", names[i]);
+		for (b = 0; b < BATCH_BUCKETS; b++)
+			len += sprintf(buf + len, " %llu", hist[b]);
+		len += sprintf(buf + len, "\n");
+	}
+	return len;
+}
+
+static enum hrtimer_restart softirq_bh(struct hrtimer *timer)
+{
+	ev_drain(container_of(timer, struct bottom_half, timer), NULL);
+	return HRTIMER_NORESTART;
+}
+
+/*	data is the bottom_half: tasklet_init(), as tasklet_setup() is 5.9+	*/
+static void tasklet_bh(unsigned long data)
+{
+	ev_drain((struct bottom_half *)data, NULL);
+}
+
+/*======================================================================================================
+ *					DEFERRAL BACK-ENDS for the work queue IRQ
+ *					-	system:		schedule_work() on system_wq
+ *					-	threaded:	request_threaded_irq(), the IRQ thread drains
+ *					-	bound, unbound, with or without WQ_HIGHPRI: a work queue
+ *						of our own
+ *					-	kthread:	a kthread_worker pinned to backend_cpu
+ *					-	per back-end: events and runs, throughput over the time
+ *						between its first and last run, wakeup latency from the
+ *						first top half after a run to the start of the next one,
+ *						and events drained on another CPU than they were raised on
+ *					-	switched with the IRQ freed, so the top half never sees a
+ *						back-end change under it
+ *======================================================================================================
+ */
+enum {
+	BACKEND_SYSTEM,
+	BACKEND_THREADED,
+	BACKEND_BOUND,
+	BACKEND_BOUND_HIGHPRI,
+	BACKEND_UNBOUND,
+	BACKEND_UNBOUND_HIGHPRI,
+	BACKEND_KTHREAD,
+	BACKEND_NR,
+};
+
+static const char * const backend_names[BACKEND_NR] = {
+	[BACKEND_SYSTEM]		= "system",
+	[BACKEND_THREADED]		= "threaded",
+	[BACKEND_BOUND]			= "bound",
+	[BACKEND_BOUND_HIGHPRI]		= "bound_highpri",
+	[BACKEND_UNBOUND]		= "unbound",
+	[BACKEND_UNBOUND_HIGHPRI]	= "unbound_highpri",
+	[BACKEND_KTHREAD]		= "kthread",
+};
+
+static const unsigned int backend_wq_flags[BACKEND_NR] = {
+	[BACKEND_BOUND_HIGHPRI]		= WQ_HIGHPRI,
+	[BACKEND_UNBOUND]		= WQ_UNBOUND,
+	[BACKEND_UNBOUND_HIGHPRI]	= WQ_UNBOUND | WQ_HIGHPRI,
+};
+
+/*
+ *	Only the back-end's bottom half writes these, and it never runs twice
+ *	at once.
+ */
+struct backend_stats {
+	u64 events;
+	u64 runs;
+	u64 migrations;
+	u64 first_ns;
+	u64 last_ns;
+	struct lat_pcpu __percpu *wake;
+};
+
+static struct {
+	unsigned int kind;
+	unsigned int cpu;		/*	of the kthread worker	*/
+	struct workqueue_struct *wq;
+	struct kthread_worker *kworker;
+	struct kthread_work kwork;
+	atomic64_t kick;		/*	ktime ns of the first unserved top half, 0 = none	*/
+	struct backend_stats stats[BACKEND_NR];
+} backend;
+
+static bool backend_is_wq(unsigned int kind)
+{
+	return kind >= BACKEND_BOUND && kind <= BACKEND_UNBOUND_HIGHPRI;
+}
+
+static void backend_run(void)
+{
+	struct backend_stats *st = &backend.stats[backend.kind];
+	u64 kick = atomic64_xchg(&backend.kick, 0), now = ktime_get_ns();
+	unsigned int n, moved;
+
+	if (kick)
+		lat_record(st->wake, now - kick);
+	n = ev_drain(&bhs[BH_WORKQUEUE], &moved);
+	if (0 == st->runs)
+		st->first_ns = now;
+	st->last_ns = now;
+	st->runs++;
+	st->events += n;
+	st->migrations += moved;
+}
+
+static void workqueue_bh(struct work_struct *work)
+{
+	backend_run();
+}
+
+static void kthread_bh(struct kthread_work *work)
+{
+	backend_run();
+}
+
+static irqreturn_t threaded_bh(int irq, void *dev)
+{
+	backend_run();
+	return IRQ_HANDLED;
+}
+
+/*
+ *	Top half side: hand the event to whichever back-end is selected.
+ *	Returns what the hard irq handler should.
+ */
+static irqreturn_t backend_kick(struct bottom_half *bh)
+{
+	atomic64_cmpxchg(&backend.kick, 0, ktime_get_ns());
+	switch (backend.kind) {
+	case BACKEND_THREADED:
+		return IRQ_WAKE_THREAD;
+	case BACKEND_KTHREAD:
+		kthread_queue_work(backend.kworker, &backend.kwork);
+		break;
+	case BACKEND_SYSTEM:
+		schedule_work(&bh->work);
+		break;
+	default:
+		queue_work(backend.wq, &bh->work);
+		break;
+	}
+	return IRQ_HANDLED;
+}
+
+/*
+ *	Create what back-end kind needs; it is not in use yet.
+ */
+static int backend_start(unsigned int kind, unsigned int cpu)
+{
+	struct kthread_worker *kworker;
+
+	if (backend_is_wq(kind)) {
+		backend.wq = alloc_workqueue("study_bh_%s", backend_wq_flags[kind], 0,
+					     backend_names[kind]);
+		if (NULL == backend.wq)
+			return -ENOMEM;
+	} else if (BACKEND_KTHREAD == kind) {
+		kworker = kthread_create_worker_on_cpu(cpu, 0, "study_bh/%u", cpu);
+		if (IS_ERR(kworker))
+			return PTR_ERR(kworker);
+		backend.kworker = kworker;
+	}
+	backend.kind = kind;
+	backend.cpu = cpu;
+	return 0;
+}
+
+/*
+ *	Wait for the back-end's last run and tear it down. The IRQ is freed.
+ */
+static void backend_stop(void)
+{
+	cancel_work_sync(&bhs[BH_WORKQUEUE].work);
+	if (backend.wq) {
+		destroy_workqueue(backend.wq);
+		backend.wq = NULL;
+	}
+	if (backend.kworker) {
+		kthread_destroy_worker(backend.kworker);
+		backend.kworker = NULL;
+	}
+	atomic64_set(&backend.kick, 0);
+}
+
+static void free_backend_stats(void)
+{
+	int i;
+
+	for (i = 0; i < BACKEND_NR; i++)
+		free_percpu(backend.stats[i].wake);
+}
+
+static int init_backend_stats(void)
+{
+	int i;
+
+	kthread_init_work(&backend.kwork, kthread_bh);
+	for (i = 0; i < BACKEND_NR; i++) {
+		backend.stats[i].wake = alloc_percpu(struct lat_pcpu);
+		if (NULL == backend.stats[i].wake) {
+			free_backend_stats();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/*
+ *	"<back-end> events runs events/s migrations" then the wakeup latency
+ *	as "count min p50 p99 max" in ns, for every back-end that ran.
+ */
+static ssize_t backend_stats_show_all(char *buf)
+{
+	struct backend_stats *st;
+	ssize_t len = 0, status;
+	u64 span;
+	int i;
+
+	for (i = 0; i < BACKEND_NR; i++) {
+		st = &backend.stats[i];
+		if (0 == READ_ONCE(st->runs))
+			continue;
+		span = READ_ONCE(st->last_ns) - READ_ONCE(st->first_ns);
+		len += sprintf(buf + len, "%-15s %llu %llu %llu %llu ", backend_names[i],
+			       READ_ONCE(st->events), READ_ONCE(st->runs),
+			       span ? div64_u64(READ_ONCE(st->events) * NSEC_PER_SEC, span) : 0,
+			       READ_ONCE(st->migrations));
+		status = lat_show(st->wake, buf + len);
+		if (status < 0)
+			return status;
+		len += status;
+	}
+	return len;
+}
+
+/*======================================================================================================
+ *					EVENT SOURCE
+ *					-	an irq_domain of our own with one virtual IRQ per bottom half,
+ *						driven by dummy_irq_chip: works the same on any arch and in
+ *						any VM, nothing is wired to hardware vectors
+ *					-	one shot events come from an irq_work queued on event_cpu
+ *					-	periodic ones from an hrtimer pinned to event_cpu, raising
+ *						every IRQ event_rate times a second
+ *					-	both call generic_handle_irq() in hard irq context, like an
+ *						interrupt controller's chained handler would
+ *======================================================================================================
+ */
+static struct fwnode_handle *event_fwnode;
+static struct irq_domain *event_domain;
+static unsigned int event_virq[BH_NR];
+static struct irq_work event_work[BH_NR];
+static struct hrtimer event_timer;
+static DEFINE_MUTEX(event_lock);	/*	event_* and storm_* changes	*/
+
+static int event_map(struct irq_domain *d, unsigned int virq, irq_hw_number_t hw)
+{
+	irq_set_chip_and_handler(virq, &dummy_irq_chip, handle_simple_irq);
+	return 0;
+}
+
+static const struct irq_domain_ops event_domain_ops = {
+	.map	= event_map,
+	.xlate	= irq_domain_xlate_onecell,
+};
+
+static void event_fire(struct irq_work *work)
+{
+	generic_handle_irq(event_virq[work - event_work]);
+}
+
+static enum hrtimer_restart event_tick(struct hrtimer *timer)
+{
+	unsigned int rate = READ_ONCE(event_rate);
+	int i;
+
+	for (i = 0; i < BH_NR; i++)
+		generic_handle_irq(event_virq[i]);
+	if (0 == rate)
+		return HRTIMER_NORESTART;
+	hrtimer_forward_now(timer, ns_to_ktime(NSEC_PER_SEC / rate));
+	return HRTIMER_RESTART;
+}
+
+/*
+ *	Runs on event_cpu, so the pinned timer stays there
+ */
+static void event_timer_start(void *unused)
+{
+	hrtimer_start(&event_timer, ns_to_ktime(NSEC_PER_SEC / event_rate),
+		      HRTIMER_MODE_REL_PINNED_HARD);
+}
+
+/*
+ *	(Re)start periodic events after event_rate or event_cpu changed.
+ *	event_lock held.
+ */
+static int event_restart(void)
+{
+	hrtimer_cancel(&event_timer);
+	if (0 == event_rate)
+		return 0;
+	return smp_call_function_single(event_cpu, event_timer_start, NULL, 1);
+}
+
+/*
+ *	Raise the IRQ of bottom half bh once, on event_cpu. An event that is
+ *	still pending absorbs the new one, as a level triggered line would.
+ */
+static int event_raise(int bh)
+{
+	unsigned int cpu = READ_ONCE(event_cpu);
+
+	if (!cpu_online(cpu))
+		return -ENXIO;
+	irq_work_queue_on(&event_work[bh], cpu);
+	return 0;
+}
+
+static int init_event_source(void)
+{
+	int i;
+
+	if (event_rate > EVENT_RATE_MAX || event_cpu >= nr_cpu_ids) {
+		pr_emerg("ERR: event_rate must be at most %d and event_cpu a valid CPU\n", EVENT_RATE_MAX);
+		return -EINVAL;
+	}
+	event_fwnode = irq_domain_alloc_named_fwnode("study_bottom_halves");
+	if (NULL == event_fwnode)
+		return -ENOMEM;
+	event_domain = irq_domain_create_linear(event_fwnode, BH_NR, &event_domain_ops, NULL);
+	if (NULL == event_domain) {
+		irq_domain_free_fwnode(event_fwnode);
+		return -ENOMEM;
+	}
+	for (i = 0; i < BH_NR; i++) {
+		event_virq[i] = irq_create_mapping(event_domain, i);
+		if (0 == event_virq[i]) {
+			while (i--)
+				irq_dispose_mapping(event_virq[i]);
+			irq_domain_remove(event_domain);
+			irq_domain_free_fwnode(event_fwnode);
+			return -ENOMEM;
+		}
+		/*
+		 *	Runs in hard irq context on the kernels the tree targets
+		 *	(up to 5.6): IRQ_WORK_INIT_HARD() only matters from 5.8
+		 *	on, with PREEMPT_RT.
+		 */
+		init_irq_work(&event_work[i], event_fire);
+	}
+	hrtimer_init(&event_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_HARD);
+	event_timer.function = event_tick;
+	return 0;
+}
+
+/*
+ *	Periodic events must be stopped first and the IRQs freed after.
+ */
+static void stop_event_source(void)
+{
+	int i;
+
+	mutex_lock(&event_lock);
+	event_rate = 0;
+	hrtimer_cancel(&event_timer);
+	mutex_unlock(&event_lock);
+	for (i = 0; i < BH_NR; i++)
+		irq_work_sync(&event_work[i]);
+}
+
+static void exit_event_source(void)
+{
+	int i;
+
+	for (i = 0; i < BH_NR; i++)
+		irq_dispose_mapping(event_virq[i]);
+	irq_domain_remove(event_domain);
+	irq_domain_free_fwnode(event_fwnode);
+}
+
+/*======================================================================================================
+ *					EVENT STORMS
+ *					-	a pinned hrtimer on each CPU in storm_cpus raises storm_rate
+ *						events a second in bursts every STORM_TICK_NS, from its own
+ *						hard irq context
+ *					-	softirq, tasklet, workqueue: each event goes through the IRQ
+ *						of that bottom half, top half included; an event that finds
+ *						the IRQ in progress on another CPU is lost, as handle_simple_irq()
+ *						skips it, and counted as a drop
+ *					-	napi: one simulated device per CPU, a FIFO of storm_fifo events
+ *						and a tasklet as its bottom half; events arriving on a full
+ *						FIFO are dropped. The top half masks the line; the bottom half
+ *						polls at most storm_budget events, polls again while it uses
+ *						the whole budget and unmasks once it does not
+ *					-	counted per mode, so the deferral paths and napi can be compared
+ *======================================================================================================
+ */
+#define STORM_TICK_NS		10000
+#define STORM_RATE_MAX		10000000	/*	per CPU	*/
+
+/*	The deferral modes are the BH_* ones	*/
+enum {
+	STORM_NAPI = BH_NR,
+	STORM_NR_MODES,
+};
+
+static const char * const storm_mode_names[STORM_NR_MODES] = {
+	[BH_SOFTIRQ]	= "softirq",
+	[BH_TASKLET]	= "tasklet",
+	[BH_WORKQUEUE]	= "workqueue",
+	[STORM_NAPI]	= "napi",
+};
+
+struct storm_stats {
+	u64 events;		/*	raised, dropped or not	*/
+	u64 drops;
+	u64 irqs;		/*	top half runs	*/
+	u64 polls;		/*	napi bottom half runs	*/
+	u64 processed;		/*	by napi polls	*/
+	u64 cpu_ns;		/*	in top and, for napi, bottom halves	*/
+};
+
+struct storm_dev {
+	struct hrtimer gen;
+	struct tasklet_struct bh;
+	unsigned int carry;	/*	events owed from rounding, in 1/tick units	*/
+	unsigned int pending;	/*	in the FIFO; irqs off to touch it	*/
+	bool masked;
+	struct storm_stats stats[STORM_NR_MODES];
+};
+
+static DEFINE_PER_CPU(struct storm_dev, storm_devs);
+static unsigned int storm_rate;
+static unsigned int storm_mode;
+static unsigned int storm_budget = 64;
+static unsigned int storm_fifo = 256;
+static struct cpumask storm_cpus;
+static bool storm_running;
+static u64 storm_bh_runs[BH_NR];	/*	during past storms; event_lock	*/
+static u64 storm_bh_base;		/*	bh_runs() at the start of this one	*/
+
+/*
+ *	Runs of bottom half i that drained events, storms or not.
+ */
+static u64 bh_runs(int i)
+{
+	u64 runs = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		runs += per_cpu_ptr(bhs[i].qstat, cpu)->drains;
+	return runs;
+}
+
+/*
+ *	Deferral modes: n events through the IRQ of bottom half bh.
+ */
+static void storm_raise(struct storm_stats *st, int bh, unsigned int n)
+{
+	struct irq_data *d = irq_get_irq_data(event_virq[bh]);
+	u64 start = local_clock();
+
+	while (n--) {
+		if (irqd_irq_inprogress(d)) {
+			st->drops++;
+			continue;
+		}
+		generic_handle_irq(event_virq[bh]);
+		st->irqs++;
+	}
+	st->cpu_ns += local_clock() - start;
+}
+
+/*
+ *	napi top half. Hard irq context, on the device's CPU.
+ */
+static void storm_irq(struct storm_dev *sd)
+{
+	u64 start = local_clock();
+	struct storm_stats *st = &sd->stats[STORM_NAPI];
+
+	st->irqs++;
+	sd->masked = true;
+	tasklet_schedule(&sd->bh);
+	st->cpu_ns += local_clock() - start;
+}
+
+/*	data is the storm_dev	*/
+static void storm_bh(unsigned long data)
+{
+	struct storm_dev *sd = (struct storm_dev *)data;
+	struct storm_stats *st = &sd->stats[STORM_NAPI];
+	u64 start = local_clock();
+	unsigned int n;
+
+	local_irq_disable();
+	n = min(sd->pending, storm_budget);
+	sd->pending -= n;
+	local_irq_enable();
+
+	st->polls++;
+	st->processed += n;
+	local_irq_disable();
+	if (n == storm_budget) {
+		/*	Budget used up: there may be more, poll again	*/
+		tasklet_schedule(&sd->bh);
+	} else {
+		sd->masked = false;
+		/*	Whatever came in meanwhile asserts the line right away	*/
+		if (sd->pending)
+			storm_irq(sd);
+	}
+	local_irq_enable();
+	st->cpu_ns += local_clock() - start;
+}
+
+/*
+ *	napi: n events into the device's FIFO.
+ */
+static void storm_queue(struct storm_dev *sd, struct storm_stats *st, unsigned int n)
+{
+	while (n--) {
+		if (sd->pending >= storm_fifo) {
+			st->drops++;
+			continue;
+		}
+		sd->pending++;
+		if (!sd->masked)
+			storm_irq(sd);
+	}
+}
+
+static enum hrtimer_restart storm_tick(struct hrtimer *timer)
+{
+	struct storm_dev *sd = container_of(timer, struct storm_dev, gen);
+	struct storm_stats *st = &sd->stats[storm_mode];
+	unsigned int ticks = NSEC_PER_SEC / STORM_TICK_NS;
+	unsigned int n;
+
+	sd->carry += storm_rate;
+	n = sd->carry / ticks;
+	sd->carry %= ticks;
+	st->events += n;
+	if (STORM_NAPI == storm_mode)
+		storm_queue(sd, st, n);
+	else
+		storm_raise(st, storm_mode, n);
+	hrtimer_forward_now(timer, ns_to_ktime(STORM_TICK_NS));
+	return HRTIMER_RESTART;
+}
+
+static void storm_start_cpu(void *unused)
+{
+	hrtimer_start(this_cpu_ptr(&storm_devs.gen), ns_to_ktime(STORM_TICK_NS),
+		      HRTIMER_MODE_REL_PINNED_HARD);
+}
+
+/*
+ *	Stop the generators first, then the bottom halves, and empty the
+ *	FIFOs so the next run starts clean. A deferral mode's bottom half
+ *	still pending here is counted with the next storm. event_lock held.
+ */
+static void storm_stop(void)
+{
+	struct storm_dev *sd;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		hrtimer_cancel(&per_cpu_ptr(&storm_devs, cpu)->gen);
+	for_each_possible_cpu(cpu) {
+		sd = per_cpu_ptr(&storm_devs, cpu);
+		tasklet_kill(&sd->bh);
+		sd->pending = 0;
+		sd->carry = 0;
+		sd->masked = false;
+	}
+	if (storm_running && STORM_NAPI != storm_mode)
+		storm_bh_runs[storm_mode] += bh_runs(storm_mode) - storm_bh_base;
+	storm_running = false;
+}
+
+/*
+ *	event_lock held.
+ */
+static int storm_start(void)
+{
+	int cpu, status;
+
+	storm_stop();
+	if (0 == storm_rate)
+		return 0;
+	if (STORM_NAPI != storm_mode)
+		storm_bh_base = bh_runs(storm_mode);
+	cpus_read_lock();
+	for_each_cpu_and(cpu, &storm_cpus, cpu_online_mask) {
+		status = smp_call_function_single(cpu, storm_start_cpu, NULL, 1);
+		if (status) {
+			cpus_read_unlock();
+			storm_stop();
+			return status;
+		}
+	}
+	cpus_read_unlock();
+	storm_running = true;
+	return 0;
+}
+
+static void init_storms(void)
+{
+	struct storm_dev *sd;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		sd = per_cpu_ptr(&storm_devs, cpu);
+		hrtimer_init(&sd->gen, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_HARD);
+		sd->gen.function = storm_tick;
+		tasklet_init(&sd->bh, storm_bh, (unsigned long)sd);
+	}
+	cpumask_copy(&storm_cpus, cpu_online_mask);
+}
+
+/*
+ *	One line per mode: events, drops, irqs, polls, processed, events
+ *	processed per bottom half run (coalescing, x100) and CPU ns per event.
+ *	For the deferral modes polls are the runs of that bottom half while a
+ *	storm was on, periodic and one shot events included, every event not
+ *	dropped is processed, bar the queue overflows in queue_stats, and the
+ *	CPU time is the top halves'; their bottom halves are in *_latency,
+ *	queue_stats and batch_sizes.
+ */
+static ssize_t storm_stats_show_all(char *buf)
+{
+	struct storm_stats sum, *st;
+	ssize_t len = 0;
+	int mode, cpu;
+
+	len += sprintf(buf, "%-9s %14s %14s %14s %14s %14s %10s %10s\n", "mode", "events", "drops",
+		       "irqs", "polls", "processed", "coal_x100", "ns/event");
+	mutex_lock(&event_lock);
+	for (mode = 0; mode < STORM_NR_MODES; mode++) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			st = &per_cpu_ptr(&storm_devs, cpu)->stats[mode];
+			sum.events += st->events;
+			sum.drops += st->drops;
+			sum.irqs += st->irqs;
+			sum.polls += st->polls;
+			sum.processed += st->processed;
+			sum.cpu_ns += st->cpu_ns;
+		}
+		if (STORM_NAPI != mode) {
+			sum.polls = storm_bh_runs[mode];
+			if (storm_running && mode == storm_mode)
+				sum.polls += bh_runs(mode) - storm_bh_base;
+			sum.processed = sum.events - sum.drops;
+		}
+		len += sprintf(buf + len, "%-9s %14llu %14llu %14llu %14llu %14llu %10llu %10llu\n",
+			       storm_mode_names[mode], sum.events, sum.drops, sum.irqs, sum.polls,
+			       sum.processed,
+			       sum.polls ? div64_u64(sum.processed * 100, sum.polls) : 0,
+			       sum.processed ? div64_u64(sum.cpu_ns, sum.processed) : 0);
+	}
+	mutex_unlock(&event_lock);
+	return len;
+}
 
 /*======================================================================================================
  *					CREATE KERNEL OBJECTS
@@ -35,33 +1060,300 @@
  *	Create kernel objects to fire the IRQs from user space.
  */
 static ssize_t raise_irq11(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
-	/*
-	 *	IRQ_VECTOR_ADDR(IRQ_NUM) to be passed to the asm.
-	 *	This only works for intel x86 arch.
-	 */
-	asm("int $0x3B");
-	return 0;
+	return event_raise(BH_SOFTIRQ);
 }
 
 static ssize_t raise_irq13(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
-	asm("int $0x3D");
-	return 0;
+	return event_raise(BH_TASKLET);
 }
 
 static ssize_t raise_irq16(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
-	asm("int $0x3A");
-	return 0;
+	return event_raise(BH_WORKQUEUE);
+}
+
+/*
+ *	event_rate: periodic events per second on each IRQ, 0 stops them
+ *	event_cpu: CPU both one shot and periodic events are raised on
+ */
+static ssize_t event_rate_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return sprintf(buf, "%u\n", READ_ONCE(event_rate));
+}
+
+static ssize_t event_rate_store(struct kobject *kobj, struct kobj_attribute *attr,
+				const char *buf, size_t count) {
+	unsigned int rate;
+	int status;
+
+	if (kstrtouint(buf, 0, &rate) || rate > EVENT_RATE_MAX)
+		return -EINVAL;
+	mutex_lock(&event_lock);
+	WRITE_ONCE(event_rate, rate);
+	status = event_restart();
+	mutex_unlock(&event_lock);
+	return status ? status : count;
+}
+
+static ssize_t event_cpu_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return sprintf(buf, "%u\n", READ_ONCE(event_cpu));
+}
+
+static ssize_t event_cpu_store(struct kobject *kobj, struct kobj_attribute *attr,
+			       const char *buf, size_t count) {
+	unsigned int cpu;
+	int status;
+
+	if (kstrtouint(buf, 0, &cpu) || cpu >= nr_cpu_ids || !cpu_online(cpu))
+		return -EINVAL;
+	mutex_lock(&event_lock);
+	WRITE_ONCE(event_cpu, cpu);
+	status = event_restart();
+	mutex_unlock(&event_lock);
+	return status ? status : count;
+}
+
+/*
+ *	Event storms, see above. Any change restarts a running storm.
+ *	-	storm_rate:	events per second per CPU, 0 stops
+ *	-	storm_cpus:	CPU list, e.g. "0-3,6"
+ *	-	storm_mode:	softirq, tasklet, workqueue or napi
+ *	-	storm_budget:	events per napi poll
+ *	-	storm_fifo:	events a napi device holds before it drops
+ *	-	storm_stats:	counters per mode
+ */
+static ssize_t storm_set(unsigned int *param, const char *buf, size_t count,
+			 unsigned int min, unsigned int max) {
+	unsigned int val;
+	int status;
+
+	if (kstrtouint(buf, 0, &val) || val < min || val > max)
+		return -EINVAL;
+	mutex_lock(&event_lock);
+	*param = val;
+	status = storm_running || param == &storm_rate ? storm_start() : 0;
+	mutex_unlock(&event_lock);
+	return status ? status : count;
+}
+
+static ssize_t storm_rate_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return sprintf(buf, "%u\n", storm_rate);
+}
+
+static ssize_t storm_rate_store(struct kobject *kobj, struct kobj_attribute *attr,
+				const char *buf, size_t count) {
+	return storm_set(&storm_rate, buf, count, 0, STORM_RATE_MAX);
+}
+
+static ssize_t storm_budget_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return sprintf(buf, "%u\n", storm_budget);
+}
+
+static ssize_t storm_budget_store(struct kobject *kobj, struct kobj_attribute *attr,
+				  const char *buf, size_t count) {
+	return storm_set(&storm_budget, buf, count, 1, UINT_MAX);
+}
+
+static ssize_t storm_fifo_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return sprintf(buf, "%u\n", storm_fifo);
+}
+
+static ssize_t storm_fifo_store(struct kobject *kobj, struct kobj_attribute *attr,
+				const char *buf, size_t count) {
+	return storm_set(&storm_fifo, buf, count, 1, UINT_MAX);
+}
+
+static ssize_t storm_mode_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return sprintf(buf, "%s\n", storm_mode_names[storm_mode]);
+}
+
+static ssize_t storm_mode_store(struct kobject *kobj, struct kobj_attribute *attr,
+				const char *buf, size_t count) {
+	int mode = sysfs_match_string(storm_mode_names, buf);
+	int status = 0;
+
+	if (mode < 0)
+		return mode;
+	mutex_lock(&event_lock);
+	if (mode != storm_mode) {
+		/*	Stopped in between: the devices are never seen half way	*/
+		storm_stop();
+		storm_mode = mode;
+		if (storm_rate)
+			status = storm_start();
+	}
+	mutex_unlock(&event_lock);
+	return status ? status : count;
+}
+
+static ssize_t storm_cpus_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return sprintf(buf, "%*pbl\n", cpumask_pr_args(&storm_cpus));
+}
+
+static ssize_t storm_cpus_store(struct kobject *kobj, struct kobj_attribute *attr,
+				const char *buf, size_t count) {
+	cpumask_var_t cpus;
+	int status;
+
+	if (!alloc_cpumask_var(&cpus, GFP_KERNEL))
+		return -ENOMEM;
+	if (cpulist_parse(buf, cpus) || cpumask_empty(cpus)) {
+		free_cpumask_var(cpus);
+		return -EINVAL;
+	}
+	mutex_lock(&event_lock);
+	cpumask_copy(&storm_cpus, cpus);
+	status = storm_running ? storm_start() : 0;
+	mutex_unlock(&event_lock);
+	free_cpumask_var(cpus);
+	return status ? status : count;
+}
+
+static ssize_t storm_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return storm_stats_show_all(buf);
+}
+
+/*
+ *	Top half to bottom half queues, see EVENT QUEUES
+ *	-	event_queue:	ring or kfifo
+ *	-	ring_depth:	events per queue
+ *	-	queue_stats:	pushes, overflows, fill and cost per bottom half
+ *	-	batch_sizes:	log2 histogram of events per drain
+ */
+static ssize_t event_queue_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return sprintf(buf, "%s\n", queue_names[READ_ONCE(event_queue)]);
+}
+
+static ssize_t event_queue_store(struct kobject *kobj, struct kobj_attribute *attr,
+				 const char *buf, size_t count) {
+	int queue = sysfs_match_string(queue_names, buf);
+
+	if (queue < 0)
+		return queue;
+	WRITE_ONCE(event_queue, queue);
+	return count;
+}
+
+static ssize_t ring_depth_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return sprintf(buf, "%u\n", ring_depth);
+}
+
+static ssize_t queue_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return queue_stats_show_all(buf);
+}
+
+static ssize_t batch_sizes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return batch_sizes_show_all(buf);
+}
+
+/*
+ *	Deferral back-end of the work queue IRQ, see DEFERRAL BACK-ENDS
+ *	-	wq_backend:	system, threaded, bound, bound_highpri, unbound,
+ *			unbound_highpri or kthread
+ *	-	backend_cpu:	CPU of the kthread worker
+ *	-	backend_stats:	throughput, migrations and wakeup latency
+ */
+static int backend_select(unsigned int kind, unsigned int cpu);
+
+static ssize_t wq_backend_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return sprintf(buf, "%s\n", backend_names[READ_ONCE(backend.kind)]);
+}
+
+static ssize_t wq_backend_store(struct kobject *kobj, struct kobj_attribute *attr,
+				const char *buf, size_t count) {
+	int kind = sysfs_match_string(backend_names, buf);
+	int status;
+
+	if (kind < 0)
+		return kind;
+	mutex_lock(&event_lock);
+	status = backend_select(kind, backend.cpu);
+	mutex_unlock(&event_lock);
+	return status ? status : count;
+}
+
+static ssize_t backend_cpu_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return sprintf(buf, "%u\n", READ_ONCE(backend.cpu));
+}
+
+static ssize_t backend_cpu_store(struct kobject *kobj, struct kobj_attribute *attr,
+				 const char *buf, size_t count) {
+	unsigned int cpu;
+	int status = 0;
+
+	if (kstrtouint(buf, 0, &cpu) || cpu >= nr_cpu_ids || !cpu_online(cpu))
+		return -EINVAL;
+	mutex_lock(&event_lock);
+	if (BACKEND_KTHREAD == backend.kind)
+		status = backend_select(BACKEND_KTHREAD, cpu);
+	else
+		WRITE_ONCE(backend.cpu, cpu);
+	mutex_unlock(&event_lock);
+	return status ? status : count;
+}
+
+static ssize_t backend_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return backend_stats_show_all(buf);
+}
+
+/*
+ *	Latency of each bottom half: "count min p50 p99 max" in ns
+ */
+static ssize_t softirq_latency_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return lat_show(bhs[BH_SOFTIRQ].lat, buf);
+}
+
+static ssize_t tasklet_latency_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return lat_show(bhs[BH_TASKLET].lat, buf);
+}
+
+static ssize_t workqueue_latency_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	return lat_show(bhs[BH_WORKQUEUE].lat, buf);
 }
 
 static struct kobject *kobj;
 static struct kobj_attribute softirq_attr = __ATTR(raise_softirq, S_IRUGO, raise_irq11, NULL);
 static struct kobj_attribute tasklet_attr = __ATTR(raise_tasklet, S_IRUGO, raise_irq13, NULL);
 static struct kobj_attribute wq_attr = __ATTR(queue_into_workqueue, S_IRUGO, raise_irq16, NULL);
+static struct kobj_attribute softirq_lat_attr = __ATTR_RO(softirq_latency);
+static struct kobj_attribute tasklet_lat_attr = __ATTR_RO(tasklet_latency);
+static struct kobj_attribute wq_lat_attr = __ATTR_RO(workqueue_latency);
+static struct kobj_attribute event_rate_attr = __ATTR_RW(event_rate);
+static struct kobj_attribute event_cpu_attr = __ATTR_RW(event_cpu);
+static struct kobj_attribute storm_rate_attr = __ATTR_RW(storm_rate);
+static struct kobj_attribute storm_cpus_attr = __ATTR_RW(storm_cpus);
+static struct kobj_attribute storm_mode_attr = __ATTR_RW(storm_mode);
+static struct kobj_attribute storm_budget_attr = __ATTR_RW(storm_budget);
+static struct kobj_attribute storm_fifo_attr = __ATTR_RW(storm_fifo);
+static struct kobj_attribute storm_stats_attr = __ATTR_RO(storm_stats);
+static struct kobj_attribute event_queue_attr = __ATTR_RW(event_queue);
+static struct kobj_attribute ring_depth_attr = __ATTR_RO(ring_depth);
+static struct kobj_attribute queue_stats_attr = __ATTR_RO(queue_stats);
+static struct kobj_attribute batch_sizes_attr = __ATTR_RO(batch_sizes);
+static struct kobj_attribute wq_backend_attr = __ATTR_RW(wq_backend);
+static struct kobj_attribute backend_cpu_attr = __ATTR_RW(backend_cpu);
+static struct kobj_attribute backend_stats_attr = __ATTR_RO(backend_stats);
 
 static struct attribute *attrs[] = {
 	&softirq_attr.attr,
 	&tasklet_attr.attr,
 	&wq_attr.attr,
+	&softirq_lat_attr.attr,
+	&tasklet_lat_attr.attr,
+	&wq_lat_attr.attr,
+	&event_rate_attr.attr,
+	&event_cpu_attr.attr,
+	&storm_rate_attr.attr,
+	&storm_cpus_attr.attr,
+	&storm_mode_attr.attr,
+	&storm_budget_attr.attr,
+	&storm_fifo_attr.attr,
+	&storm_stats_attr.attr,
+	&event_queue_attr.attr,
+	&ring_depth_attr.attr,
+	&queue_stats_attr.attr,
+	&batch_sizes_attr.attr,
+	&wq_backend_attr.attr,
+	&backend_cpu_attr.attr,
+	&backend_stats_attr.attr,
 	NULL,
 };
 
@@ -84,10 +1376,10 @@ static struct attribute_group attr_gp = {
  *	Handler to trigger a softirq
  */
 static irqreturn_t handler1(int irq, void *dev) {
-	unsigned long flags;
-	local_irq_save(flags);
+	struct bottom_half *bh = dev;
 	CALL(pr_emerg("VSDBG: In the IRQ %d handler\n", irq));
-	local_irq_restore(flags);
+	ev_push(bh);
+	hrtimer_start(&bh->timer, 0, HRTIMER_MODE_REL_SOFT);
 	return IRQ_HANDLED;
 }
 
@@ -95,10 +1387,10 @@ static irqreturn_t handler1(int irq, void *dev) {
  *	Handler to trigger a tasklet
  */
 static irqreturn_t handler2(int irq, void *dev) {
-	unsigned long flags;
-	local_irq_save(flags);
+	struct bottom_half *bh = dev;
 	CALL(pr_emerg("VSDBG: In the IRQ %d handler\n", irq));
-	local_irq_restore(flags);
+	ev_push(bh);
+	tasklet_schedule(&bh->tasklet);
 	return IRQ_HANDLED;
 }
 
@@ -106,54 +1398,232 @@ static irqreturn_t handler2(int irq, void *dev) {
  *	Handler to schedule work
  */
 static irqreturn_t handler3(int irq, void *dev) {
-	unsigned long flags;
-	local_irq_save(flags);
+	struct bottom_half *bh = dev;
 	CALL(pr_emerg("VSDBG: In the IRQ %d handler\n", irq));
-	local_irq_restore(flags);
-	return IRQ_HANDLED;
+	ev_push(bh);
+	return backend_kick(bh);
 }
 
-static int __init init_irq_module(void)
+static bool wq_irq_requested;
+
+static int request_wq_irq(void)
 {
 	int status;
+
+	status = request_threaded_irq(event_virq[BH_WORKQUEUE], handler3,
+				      BACKEND_THREADED == backend.kind ? threaded_bh : NULL,
+				      0, "Indirect wq handler", &bhs[BH_WORKQUEUE]);
+	wq_irq_requested = !status;
+	return status;
+}
+
+static void free_wq_irq(void)
+{
+	if (wq_irq_requested)
+		free_irq(event_virq[BH_WORKQUEUE], &bhs[BH_WORKQUEUE]);
+	wq_irq_requested = false;
+}
+
+/*
+ *	Switch the work queue IRQ to back-end kind, its worker on cpu. With
+ *	the IRQ freed in between, an event raised meanwhile is simply lost.
+ *	event_lock held.
+ */
+static int backend_select(unsigned int kind, unsigned int cpu)
+{
+	unsigned int old_kind = backend.kind, old_cpu = backend.cpu;
+	int status;
+
+	free_wq_irq();
+	backend_stop();
+	status = backend_start(kind, cpu);
+	if (status && backend_start(old_kind, old_cpu))
+		/*	Back to what worked before, or at least the system wq	*/
+		backend_start(BACKEND_SYSTEM, cpu);
+	if (request_wq_irq()) {
+		pr_emerg("ERR: Couldn't request the work queue IRQ again\n");
+		return -EIO;
+	}
+	return status;
+}
+
+/*
+ *	Safe on a half set up bottom half.
+ */
+static void free_bottom_half(struct bottom_half *bh)
+{
+	int cpu;
+
+	if (bh->rings)
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(bh->rings, cpu)->recs);
+	free_percpu(bh->rings);
+	kfifo_free(&bh->fifo);
+	free_percpu(bh->qstat);
+	free_percpu(bh->lat);
+}
+
+static int alloc_bottom_half(struct bottom_half *bh)
+{
+	struct ev_ring *ring;
+	int cpu;
+
+	spin_lock_init(&bh->fifo_lock);
+	bh->rings = alloc_percpu(struct ev_ring);
+	bh->qstat = alloc_percpu(struct queue_pcpu);
+	bh->lat = alloc_percpu(struct lat_pcpu);
+	if (NULL == bh->rings || NULL == bh->qstat || NULL == bh->lat ||
+	    kfifo_alloc(&bh->fifo, ring_depth, GFP_KERNEL))
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(bh->rings, cpu);
+		/*	Next to the CPU that fills it	*/
+		ring->recs = kcalloc_node(ring_depth, sizeof(*ring->recs), GFP_KERNEL,
+					  cpu_to_node(cpu));
+		if (NULL == ring->recs)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+static int init_bottom_halves(void)
+{
+	int i;
+
+	if (ring_depth < 2 || ring_depth > 65536 || !is_power_of_2(ring_depth)) {
+		pr_emerg("ERR: ring_depth must be a power of 2 from 2 to 65536\n");
+		return -EINVAL;
+	}
+	for (i = 0; i < BH_NR; i++) {
+		if (alloc_bottom_half(&bhs[i])) {
+			do
+				free_bottom_half(&bhs[i]);
+			while (i--);
+			return -ENOMEM;
+		}
+	}
+	hrtimer_init(&bhs[BH_SOFTIRQ].timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	bhs[BH_SOFTIRQ].timer.function = softirq_bh;
+	tasklet_init(&bhs[BH_TASKLET].tasklet, tasklet_bh, (unsigned long)&bhs[BH_TASKLET]);
+	INIT_WORK(&bhs[BH_WORKQUEUE].work, workqueue_bh);
+	return 0;
+}
+
+/*
+ *	Only once the top halves are gone: nothing can schedule them again.
+ */
+static void exit_bottom_halves(void)
+{
+	int i;
+
+	hrtimer_cancel(&bhs[BH_SOFTIRQ].timer);
+	tasklet_kill(&bhs[BH_TASKLET].tasklet);
+	cancel_work_sync(&bhs[BH_WORKQUEUE].work);
+	for (i = 0; i < BH_NR; i++)
+		free_bottom_half(&bhs[i]);
+}
+
+static void free_irqs(void)
+{
+	free_irq(event_virq[BH_SOFTIRQ], &bhs[BH_SOFTIRQ]);
+	free_irq(event_virq[BH_TASKLET], &bhs[BH_TASKLET]);
+	free_wq_irq();
+}
+
+static int __init init_irq_module(void)
+{
+	int status, kind;
+	kind = match_string(backend_names, BACKEND_NR, wq_backend);
+	if (kind < 0 || backend_cpu >= nr_cpu_ids || !cpu_online(backend_cpu)) {
+		pr_emerg("ERR: Unknown wq_backend %s or offline backend_cpu %u\n", wq_backend, backend_cpu);
+		return -EINVAL;
+	}
+	status = init_bottom_halves();
+	if (status)
+		return status;
+	status = init_backend_stats();
+	if (status)
+		goto free_bh;
+	status = backend_start(kind, backend_cpu);
+	if (status) {
+		free_backend_stats();
+		goto free_bh;
+	}
+	status = init_event_source();
+	if (status)
+		goto free_backend;
+	init_storms();
+	status = -EIO;
 	PS("=============================================================================");
 	PS("-----------------------------------------------------------");
 	PS("Assign IRQ");
-	if (request_irq(IRQ_NUM1, handler1, IRQF_SHARED, "Indirect softirq handler", (void *)handler1)) {
-		pr_emerg("VSDBG: IRQ %d registration unsuccessful\n", IRQ_NUM1);
-		return -EIO;
+	if (request_irq(event_virq[BH_SOFTIRQ], handler1, 0, "Indirect softirq handler", &bhs[BH_SOFTIRQ])) {
+		pr_emerg("VSDBG: IRQ %d registration unsuccessful\n", event_virq[BH_SOFTIRQ]);
+		goto free_events;
 	}
-	if (request_irq(IRQ_NUM2, handler2, IRQF_SHARED, "Indirect tasklet handler", (void *)handler2)) {
-		pr_emerg("VSDBG: IRQ %d registration unsuccessful\n", IRQ_NUM2);
-		return -EIO;
+	if (request_irq(event_virq[BH_TASKLET], handler2, 0, "Indirect tasklet handler", &bhs[BH_TASKLET])) {
+		pr_emerg("VSDBG: IRQ %d registration unsuccessful\n", event_virq[BH_TASKLET]);
+		goto free_irq1;
 	}
-	if (request_irq(IRQ_NUM3, handler3, IRQF_SHARED, "Indirect wq handler", (void *)handler3)) {
-		pr_emerg("VSDBG: IRQ %d registration unsuccessful\n", IRQ_NUM3);
-		return -EIO;
+	if (request_wq_irq()) {
+		pr_emerg("VSDBG: IRQ %d registration unsuccessful\n", event_virq[BH_WORKQUEUE]);
+		goto free_irq2;
 	}
 
 	kobj = kobject_create_and_add("study_bottom_halves", kernel_kobj);
 	if (NULL == kobj) {
 		pr_emerg("ERR: Couldn't create kernel obj\n");
-		return -EIO;
+		goto free_irq3;
 	}
 	status = sysfs_create_group(kobj, &attr_gp);
 	if (status) {
 		pr_emerg("ERR: Couldn't create sysfs group\n");
-		return status;
+		kobject_put(kobj);
+		goto free_irq3;
+	}
+	mutex_lock(&event_lock);
+	status = event_restart();
+	mutex_unlock(&event_lock);
+	if (status) {
+		pr_emerg("ERR: Couldn't start events on CPU %u\n", event_cpu);
+		sysfs_remove_group(kobj, &attr_gp);
+		kobject_put(kobj);
+		goto free_irq3;
 	}
 	return 0;
+
+free_irq3:
+	stop_event_source();
+	free_wq_irq();
+free_irq2:
+	free_irq(event_virq[BH_TASKLET], &bhs[BH_TASKLET]);
+free_irq1:
+	free_irq(event_virq[BH_SOFTIRQ], &bhs[BH_SOFTIRQ]);
+free_events:
+	exit_event_source();
+free_backend:
+	backend_stop();
+	free_backend_stats();
+free_bh:
+	exit_bottom_halves();
+	return status;
 }
 
 static void __exit exit_irq_module(void)
 {
 	PS("-----------------------------------------------------------");
 	PS("Free IRQs");
-	free_irq(IRQ_NUM1, (void *)handler1);
-	free_irq(IRQ_NUM2, (void *)handler2);
-	free_irq(IRQ_NUM3, (void *)handler3);
 	sysfs_remove_group(kobj, &attr_gp);
-	kobject_del(kobj);
+	kobject_put(kobj);
+	mutex_lock(&event_lock);
+	storm_stop();
+	mutex_unlock(&event_lock);
+	stop_event_source();
+	free_irqs();
+	backend_stop();
+	exit_event_source();
+	exit_bottom_halves();
+	free_backend_stats();
 }
 
 module_init(init_irq_module);
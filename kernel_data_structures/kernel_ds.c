@@ -2,11 +2,21 @@
 #include <linux/kernel.h>
 #include <linux/printk.h>
 #include <linux/list.h>		/* 	Linked list routines 	*/
-#include <linux/slab.h>		/*	kzalloc			*/
+#include <linux/slab.h>		/*	kmem_cache		*/
 #include <linux/kfifo.h>	/*	Queue routines		*/
-#include <linux/hashtable.h>	/*	hash table macros	*/
+#include <linux/rhashtable.h>	/*	resizable hash table	*/
 #include <linux/types.h>	/*	hash node and hash list	*/
 #include <linux/rbtree.h>	/*	red black trees		*/
+#include <linux/rcupdate.h>	/*	lock free lookups	*/
+#include <linux/vmalloc.h>	/*	benchmark records	*/
+#include <linux/ktime.h>
+#include <linux/sched.h>	/*	cond_resched		*/
+#include <linux/xarray.h>	/*	benchmark suite		*/
+#include <linux/sort.h>
+#include <linux/timex.h>	/*	get_cycles		*/
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "kernel_ds.h"
 
@@ -49,13 +59,30 @@ struct emp_record {
 	unsigned long long sal;
 	/*	Add a list node to create a linked list	*/
 	struct list_head list;
-	/*	Add a hash node to create a hash table	*/
-	struct hlist_node node;
+	/*	Add a hash node to put it in the resizable hash table	*/
+	struct rhash_head node;
 	/*	Add a rb tree node to form a rb tree	*/
 	struct rb_node tree_node;
 };
 
-static void init_records(void) {
+/*
+ *	Records come from a slab cache of their own
+ *	-	every record starts on a cacheline, so two records never share one
+ *		and a lookup touches as few lines as possible
+ *	-	shows up as emp_record in /proc/slabinfo, so leaks are easy to spot
+ *	-	big record sets are allocated and freed in bulk, see RECORD SETS
+ */
+static struct kmem_cache *emp_cache;
+
+/*
+ *	Not on any list, table or tree yet
+ */
+static void init_record_links(struct emp_record *rec) {
+	INIT_LIST_HEAD(&(rec->list));
+	RB_CLEAR_NODE(&(rec->tree_node));
+}
+
+static int init_records(void) {
 	/*	Add dummy names, ids, and salaries, add more random data later	*/
 	char *names[MAX_EMPS] = {"bob", "carl", "james", "elaine", "kath"};
 	unsigned int ids[MAX_EMPS] = {10, 23, 45, 36, 67};
@@ -66,14 +93,17 @@ static void init_records(void) {
 	struct emp_record *rec = NULL;
 	for (i=0; i<MAX_EMPS; i++) {
 		/*	Dynamically allocate memory for each record	*/
-		rec = kzalloc(sizeof(struct emp_record), GFP_KERNEL);
+		rec = kmem_cache_zalloc(emp_cache, GFP_KERNEL);
+		if (NULL == rec)
+			return -ENOMEM;
 		strcpy(rec->name, names[i]);
 		rec->id = ids[i];
 		rec->sal = sals[i];
 		/*	Initialize the list variable & add it to the chain	*/
-		INIT_LIST_HEAD(&(rec->list));
+		init_record_links(rec);
 		list_add(&(rec->list), &emp_rcrd_head);
 	}
+	return 0;
 }
 
 static void print_records(void) {
@@ -84,17 +114,6 @@ static void print_records(void) {
 	}
 }
 
-/*
- *	Fix me: Buggy as of now. Revisit later.
- */
-static void delete_records(void) {
-	struct emp_record *rec = NULL;
-	if (list_empty(&emp_rcrd_head))	return;
-	list_for_each_entry(rec, &emp_rcrd_head, list) {
-		list_del(&(rec->list));
-		kfree(rec);
-	}
-}
 
 /*==================================================================================================================
  *					STACK: to be implemented. (Plan is to use LL in reverse)
@@ -174,91 +193,177 @@ static void delete_q(void) {
  */
 
 /*
- *	Hash table with the following specifics
- *	-	16 buckets (4 bits)
- *	-	hash function - remainder of Emp ID when divided by 16.
- *	-	Right now not taking care of large key values. Hence sticking to int.
+ *	Resizable hash table (rhashtable) with the following specifics
+ *	-	key is the Emp ID; jhash mixes it, so no key pattern piles up
+ *		in a few buckets the way a plain modulo did
+ *	-	grows when it is 75% full and shrinks when it is 30% full, in
+ *		a worker, so chains stay short at any record count
+ *	-	lookups only take rcu_read_lock(): no lock, safe against
+ *		concurrent inserts, removals and resizes
+ *	-	inserts and removals lock just the bucket they touch
  */
 
 /*
- *	Buckets is key for hash table --> experiment more later.
- *	-	num of buckets is in powers of 2.
- *	-	experiment on hash function.
- */
-#define NUM_BITS_FOR_HASH_BUCKETS	4
-/*	Fix this: Library wrapper function not working	*/
-//hash_init(hash_tbl);
-/*
- *	Hash table is decalared as below.
- *	Explore hashtable.h to understand how this macro
- *	expands to a hash list per bucket.
- *
- *	Each hash list is a linked list of data (values) with the same key
- *	from the hash function.
+ *	All the table needs to know about the record: where the key and the
+ *	hash node sit in it.
  */
-DECLARE_HASHTABLE(hash_tbl, NUM_BITS_FOR_HASH_BUCKETS);
+static const struct rhashtable_params emp_ht_params = {
+	.key_len		= sizeof(unsigned int),
+	.key_offset		= offsetof(struct emp_record, id),
+	.head_offset		= offsetof(struct emp_record, node),
+	.automatic_shrinking	= true,
+};
 
-/*	Toy hash function.	*/
-static void hash_fn(int val, int *key) {
-	*key = val % (1 << (NUM_BITS_FOR_HASH_BUCKETS));
-}
+static struct rhashtable hash_tbl;
 
-static void init_hash_tbl(void) {
-	int key;
+static int init_hash_tbl(void) {
+	int ret;
 	struct emp_record *rec = NULL;
-	/*	WAR: since hash_init lib call was not working	*/
-	__hash_init(hash_tbl, (ARRAY_SIZE(hash_tbl)));
+	ret = rhashtable_init(&hash_tbl, &emp_ht_params);
+	if (ret) {
+		pr_emerg("VSDBG: No memory for hash table\n");
+		return ret;
+	}
 	/*	Take each record from the list and also add it to hash table	*/
 	list_for_each_entry(rec, &emp_rcrd_head, list) {
-		/*	Find the key	*/
-		hash_fn(rec->id, &key);
 		/*
-		 *	Add it to the hash table. fn takes in hash table,
-		 *	hash node from the struct and the key found
+		 *	The key is read from the record itself, through
+		 *	key_offset. Fails with -EEXIST on a duplicate ID.
 		 */
-		hash_add(hash_tbl, &(rec->node), key);
+		ret = rhashtable_insert_fast(&hash_tbl, &(rec->node), emp_ht_params);
+		if (ret)
+			pr_emerg("VSDBG: ID%d not added to hash table: %d\n", rec->id, ret);
 	}
+	return 0;
 }
 
 /*
  *	Printing the whole hash table.
  *	-	Usually not in practice. Just an example.
+ *	-	A walker may see a record twice, or miss one, if the table
+ *		is resized meanwhile; -EAGAIN tells it so.
  */
 static void print_hash_tbl(void) {
-	int bkt;
+	struct rhashtable_iter iter;
 	struct emp_record *rec = NULL;
-	/*
-	 *	hash_for_each
-	 *	-	hash table
-	 *	-	bkt is a loop variable
-	 *	-	rec is struct variable
-	 *	-	node from the struct
-	 *	Internally uses container_of.
-	 */
-	hash_for_each(hash_tbl, bkt, rec, node) {
+	rhashtable_walk_enter(&hash_tbl, &iter);
+	rhashtable_walk_start(&iter);
+	while (NULL != (rec = rhashtable_walk_next(&iter))) {
+		if (IS_ERR(rec))
+			continue;
 		CALL(pr_emerg("VSDBG: %s %d %lld\n", rec->name, rec->id, rec->sal));
 	}
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
 }
 
-static void look_up_hash_tbl(int val) {
-	int key;
+static void look_up_hash_tbl(unsigned int val) {
 	struct emp_record *rec = NULL;
-	/*	First find the key from the hash_fn	*/
-	hash_fn(val, &key);
 	/*
-	 *	hash_for_each_possible
-	 *	-	hash table
-	 *	-	rec to fetch the struct of interest
-	 *	-	node in the struct
-	 *	-	key based list will be iterated.
+	 *	The record found may only be used inside the RCU read side
+	 *	section: a concurrent removal frees it after a grace period.
 	 */
-	hash_for_each_possible(hash_tbl, rec, node, key) {
-		if (rec->id == val)	{
-			pr_emerg("VSDBG: ID%d emp name found:%s\n", val, rec->name);
-			return;
+	rcu_read_lock();
+	rec = rhashtable_lookup(&hash_tbl, &val, emp_ht_params);
+	if (rec)
+		pr_emerg("VSDBG: ID%d emp name found:%s\n", val, rec->name);
+	else
+		pr_emerg("VSDBG: ID%d emp name not found!\n", val);
+	rcu_read_unlock();
+}
+
+/*
+ *	Hash table benchmark, run at load when hash_bench_max is set
+ *	-	fill a table of its own with 10, 100, ... up to hash_bench_max
+ *		records
+ *	-	at each size time HASH_BENCH_LOOKUPS lookups of random IDs that
+ *		are in the table
+ *	-	ns per lookup should stay flat while the table grows
+ */
+#define HASH_BENCH_LOOKUPS	1000000
+#define HASH_BENCH_CHUNK	10000	/*	lookups per RCU read side section	*/
+
+static unsigned int hash_bench_max;
+module_param(hash_bench_max, uint, 0444);
+MODULE_PARM_DESC(hash_bench_max, "Largest record count of the hash table benchmark, 0 = do not run it (default: 0)");
+
+/*
+ *	Only what the table touches: 16 bytes a record, where a whole
+ *	emp_record would take 1.7 GB at 10M records
+ */
+struct hash_bench_node {
+	unsigned int id;
+	struct rhash_head node;
+};
+
+static const struct rhashtable_params hash_bench_params = {
+	.key_len		= sizeof(unsigned int),
+	.key_offset		= offsetof(struct hash_bench_node, id),
+	.head_offset		= offsetof(struct hash_bench_node, node),
+	.automatic_shrinking	= true,
+};
+
+/*	xorshift32: cheap enough not to show in ns per lookup	*/
+static u32 bench_rand(u32 *state) {
+	u32 x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void bench_hash_tbl(unsigned int max) {
+	struct hash_bench_node *recs;
+	struct rhashtable ht;
+	unsigned int n = 0, size, i, id, misses;
+	u32 seed = 0x9e3779b9;
+	u64 start, ns;
+	int ret;
+
+	recs = vzalloc(array_size(max, sizeof(*recs)));
+	if (NULL == recs) {
+		pr_emerg("VSDBG: No memory for %u benchmark records\n", max);
+		return;
+	}
+	if (rhashtable_init(&ht, &hash_bench_params)) {
+		vfree(recs);
+		return;
+	}
+	for (size = min(10U, max); ; size = min_t(u64, (u64)size * 10, max)) {
+		for (; n < size; n++) {
+			recs[n].id = n;
+			ret = rhashtable_insert_fast(&ht, &recs[n].node, hash_bench_params);
+			if (ret) {
+				pr_emerg("VSDBG: benchmark insert failed at %u records: %d\n", n, ret);
+				goto out;
+			}
+			if (0 == n % HASH_BENCH_CHUNK)
+				cond_resched();
+		}
+		misses = 0;
+		start = ktime_get_ns();
+		for (i = 0; i < HASH_BENCH_LOOKUPS; i++) {
+			if (0 == i % HASH_BENCH_CHUNK) {
+				if (i)
+					rcu_read_unlock();
+				cond_resched();
+				rcu_read_lock();
+			}
+			id = bench_rand(&seed) % n;
+			if (NULL == rhashtable_lookup(&ht, &id, hash_bench_params))
+				misses++;
 		}
+		rcu_read_unlock();
+		ns = ktime_get_ns() - start;
+		pr_emerg("VSDBG: rhashtable %u records: %llu ns/lookup, %u misses\n",
+			 n, div_u64(ns, HASH_BENCH_LOOKUPS), misses);
+		if (size == max)
+			break;
 	}
-	pr_emerg("VSDBG: ID%d emp name not found!\n", val);
+out:
+	/*	The records live in recs, nothing to free one by one	*/
+	rhashtable_destroy(&ht);
+	vfree(recs);
 }
 
 /*==================================================================================================================
@@ -346,13 +451,833 @@ static void create_rb_tree(void) {
 	}
 }
 
+/*==================================================================================================================
+ *					RECORD SETS
+ *==================================================================================================================
+ */
+
+/*
+ *	Load nr_records more records at module load, on top of the dummy ones
+ *	-	IDs from LOAD_FIRST_ID up, names emp<ID>
+ *	-	allocated EMP_BULK at a time with kmem_cache_alloc_bulk()
+ *	-	each one goes on the list, in the hash table and in the rb tree
+ *	-	load and unload times are logged
+ */
+#define EMP_BULK	64
+#define LOAD_FIRST_ID	1000
+
+static unsigned int nr_records;
+module_param(nr_records, uint, 0444);
+MODULE_PARM_DESC(nr_records, "Records to load on top of the dummy ones (default: 0)");
+
+static int load_records(unsigned int nr) {
+	void *objs[EMP_BULK];
+	struct emp_record *rec;
+	unsigned int done = 0, n, i;
+	u64 start = ktime_get_ns();
+	int ret;
+
+	while (done < nr) {
+		n = min(nr - done, (unsigned int)EMP_BULK);
+		/*	All n or none	*/
+		if (!kmem_cache_alloc_bulk(emp_cache, GFP_KERNEL | __GFP_ZERO, n, objs))
+			return -ENOMEM;
+		for (i = 0; i < n; i++) {
+			rec = objs[i];
+			rec->id = LOAD_FIRST_ID + done + i;
+			snprintf(rec->name, sizeof(rec->name), "emp%u", rec->id);
+			init_record_links(rec);
+			list_add_tail(&(rec->list), &emp_rcrd_head);
+			ret = rhashtable_insert_fast(&hash_tbl, &(rec->node), emp_ht_params);
+			if (ret) {
+				/*	The rest of the batch is not on the list yet	*/
+				kmem_cache_free_bulk(emp_cache, n - i - 1, &objs[i + 1]);
+				return ret;
+			}
+			ins_rb(&root, rec);
+		}
+		done += n;
+		cond_resched();
+	}
+	pr_emerg("VSDBG: loaded %u records in %llu us\n", nr, div_u64(ktime_get_ns() - start, NSEC_PER_USEC));
+	return 0;
+}
+
+/*
+ *	Free every record on the list, EMP_BULK at a time. They must be off
+ *	the hash table and the rb tree by now.
+ *	-	the list is walked with the _safe iterator: the record in hand is
+ *		freed before the walk moves on
+ */
+static unsigned int free_records(void) {
+	struct emp_record *rec = NULL, *tmp = NULL;
+	void *objs[EMP_BULK];
+	unsigned int n = 0, nr = 0;
+
+	list_for_each_entry_safe(rec, tmp, &emp_rcrd_head, list) {
+		list_del(&(rec->list));
+		objs[n++] = rec;
+		nr++;
+		if (EMP_BULK == n) {
+			kmem_cache_free_bulk(emp_cache, n, objs);
+			n = 0;
+			cond_resched();
+		}
+	}
+	if (n)
+		kmem_cache_free_bulk(emp_cache, n, objs);
+	return nr;
+}
+
+/*
+ *	Unlink every record from the hash table and the rb tree, then free them.
+ *	-	lookups in the hash table only hold rcu_read_lock(), so no record
+ *		is freed before a grace period has passed since its removal
+ */
+static void delete_records(void) {
+	struct emp_record *rec = NULL;
+	u64 start = ktime_get_ns();
+	unsigned int n = 0;
+
+	if (list_empty(&emp_rcrd_head))	return;
+	list_for_each_entry(rec, &emp_rcrd_head, list) {
+		/*	-ENOENT if it never made it in, e.g. a duplicate ID	*/
+		rhashtable_remove_fast(&hash_tbl, &(rec->node), emp_ht_params);
+		if (!RB_EMPTY_NODE(&(rec->tree_node)))
+			rb_erase(&(rec->tree_node), &root);
+		if (0 == ++n % EMP_BULK)
+			cond_resched();
+	}
+	synchronize_rcu();
+	pr_emerg("VSDBG: unloaded %u records in %llu us\n", free_records(), div_u64(ktime_get_ns() - start, NSEC_PER_USEC));
+}
+
+/*==================================================================================================================
+ *					BENCHMARK SUITE
+ *					-	list, hash table, rb tree, xarray and sorted array built from the same keys
+ *					-	ns/op, cycles/op and bytes/record in /sys/kernel/debug/kernel_ds/bench
+ *==================================================================================================================
+ */
+
+/*
+ *	Every structure is built, measured and freed before the next one
+ *	-	insert:	bench_records keys, in rank order
+ *	-	hit:	bench_lookups lookups of keys that are in
+ *	-	miss:	bench_lookups lookups of keys that are not
+ *	-	scan:	all records in key order, rbtree, xarray and array only
+ *	-	delete:	records removed one at a time
+ *	Keys, from bench_dist
+ *	-	seq:	rank r is key r, inserted and looked up in order
+ *	-	random:	keys scattered over 32 bits, lookups uniform
+ *	-	zipf:	keys scattered, lookups skewed, rank r hit ~1/r of the time
+ *	Ops that are O(n) per call (list lookups and deletes, array deletes)
+ *	are sampled over BENCH_SLOW_WORK / bench_records calls, spread over
+ *	the whole key set. The table says over how many.
+ */
+#define BENCH_MAX_RECORDS	10000000
+#define BENCH_CHUNK		10000		/*	ops between cond_resched() calls	*/
+#define BENCH_SLOW_WORK		10000000	/*	records an O(n) phase may walk		*/
+#define BENCH_SCATTER		0x9e3779b1	/*	odd: rank * BENCH_SCATTER never repeats	*/
+
+static unsigned int bench_records;
+module_param(bench_records, uint, 0644);
+MODULE_PARM_DESC(bench_records, "Records per structure for the benchmark suite, up to 10M, 0 = do not run it at load (default: 0)");
+
+static char *bench_dist = "random";
+module_param(bench_dist, charp, 0644);
+MODULE_PARM_DESC(bench_dist, "Benchmark key distribution: seq, random or zipf (default: random)");
+
+static char *bench_ops = "insert,hit,miss,scan,delete";
+module_param(bench_ops, charp, 0644);
+MODULE_PARM_DESC(bench_ops, "Benchmark operations to time, comma separated (default: insert,hit,miss,scan,delete)");
+
+static unsigned int bench_lookups = 1000000;
+module_param(bench_lookups, uint, 0644);
+MODULE_PARM_DESC(bench_lookups, "Lookups per hit and per miss phase, up to 10M (default: 1000000)");
+
+enum bench_ds { BENCH_LIST, BENCH_HASH, BENCH_RBTREE, BENCH_XARRAY, BENCH_ARRAY, BENCH_DS_NR };
+enum bench_op { BENCH_INSERT, BENCH_HIT, BENCH_MISS, BENCH_SCAN, BENCH_DELETE, BENCH_OP_NR };
+enum bench_dist { BENCH_SEQ, BENCH_RANDOM, BENCH_ZIPF, BENCH_DIST_NR };
+
+static const char * const bench_ds_names[BENCH_DS_NR] = {"list", "hash", "rbtree", "xarray", "array"};
+static const char * const bench_op_names[BENCH_OP_NR] = {"insert", "hit", "miss", "scan", "delete"};
+static const char * const bench_dist_names[BENCH_DIST_NR] = {"seq", "random", "zipf"};
+
+struct bench_result {
+	u64 ops[BENCH_OP_NR];		/*	0: not timed	*/
+	u64 ns[BENCH_OP_NR];
+	u64 cycles[BENCH_OP_NR];
+	u64 bytes;			/*	per record, once all are in	*/
+};
+
+/*	One run, filled from the parameters when it starts	*/
+static struct bench_state {
+	unsigned int nr;
+	unsigned int lookups;
+	enum bench_dist dist;
+	unsigned long ops;		/*	BIT(enum bench_op)	*/
+	u32 *hit_keys;
+	u32 *miss_keys;
+	int err;
+	struct bench_result res[BENCH_DS_NR];
+} bench;
+
+/*	Serialises runs against each other and against reading the table	*/
+static DEFINE_MUTEX(bench_lock);
+static struct dentry *bench_dir;
+/*	Keeps the compiler from dropping a scan nobody looks at	*/
+static u32 bench_sink;
+
+/*
+ *	The structures, one at a time
+ *	-	list, hash and rbtree nodes embed the key, like emp_record does
+ *	-	xarray and array map the key to where the record would be
+ */
+struct bench_list_node {
+	struct list_head list;
+	u32 key;
+};
+
+struct bench_hash_node {
+	struct rhash_head node;
+	u32 key;
+};
+
+struct bench_rb_node {
+	struct rb_node node;
+	u32 key;
+};
+
+struct bench_slot {
+	u32 key;
+	void *rec;
+};
+
+static const struct rhashtable_params bench_ht_params = {
+	.key_len		= sizeof(u32),
+	.key_offset		= offsetof(struct bench_hash_node, key),
+	.head_offset		= offsetof(struct bench_hash_node, node),
+	.automatic_shrinking	= true,
+};
+
+static struct kmem_cache *bench_cache;
+static LIST_HEAD(bench_list);
+static struct rhashtable bench_ht;
+static struct rb_root bench_rb = RB_ROOT;
+static DEFINE_XARRAY(bench_xa);
+static struct bench_slot *bench_array;
+static unsigned int bench_array_len;
+
+static u32 bench_key(unsigned int rank) {
+	return BENCH_SEQ == bench.dist ? rank : rank * BENCH_SCATTER;
+}
+
+/*	Rank of the i-th lookup	*/
+static unsigned int bench_pick(unsigned int i, u32 *seed) {
+	unsigned int lo;
+	switch (bench.dist) {
+	case BENCH_SEQ:
+		return i % bench.nr;
+	case BENCH_ZIPF:
+		/*
+		 *	Zipf with s = 1, an octave at a time: rank r in
+		 *	[2^b - 1, 2^(b+1) - 1) for a uniform b, then uniform
+		 *	inside the octave.
+		 */
+		lo = 1U << (bench_rand(seed) % (ilog2(bench.nr) + 1));
+		return lo - 1 + bench_rand(seed) % (min(2 * lo, bench.nr + 1) - lo);
+	default:
+		return bench_rand(seed) % bench.nr;
+	}
+}
+
+static struct bench_rb_node *bench_rb_find(u32 key) {
+	struct rb_node *node = bench_rb.rb_node;
+	struct bench_rb_node *rn;
+	while (NULL != node) {
+		rn = rb_entry(node, struct bench_rb_node, node);
+		if (key < rn->key)
+			node = node->rb_left;
+		else if (key > rn->key)
+			node = node->rb_right;
+		else
+			return rn;
+	}
+	return NULL;
+}
+
+static int bench_rb_insert(struct bench_rb_node *new) {
+	struct rb_node **link = &(bench_rb.rb_node);
+	struct rb_node *parent = NULL;
+	struct bench_rb_node *rn;
+	while (NULL != *link) {
+		parent = *link;
+		rn = rb_entry(parent, struct bench_rb_node, node);
+		if (new->key < rn->key)
+			link = &(parent->rb_left);
+		else if (new->key > rn->key)
+			link = &(parent->rb_right);
+		else
+			return -EEXIST;
+	}
+	rb_link_node(&(new->node), parent, link);
+	rb_insert_color(&(new->node), &bench_rb);
+	return 0;
+}
+
+/*	Index of key in the sorted array, -1 if it is not there	*/
+static int bench_array_find(u32 key) {
+	unsigned int lo = 0, hi = bench_array_len, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (bench_array[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < bench_array_len && key == bench_array[lo].key) ? lo : -1;
+}
+
+static int bench_slot_cmp(const void *a, const void *b) {
+	u32 x = ((const struct bench_slot *)a)->key;
+	u32 y = ((const struct bench_slot *)b)->key;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_hash_free(void *ptr, void *arg) {
+	kmem_cache_free(bench_cache, ptr);
+}
+
+static int bench_setup(enum bench_ds ds) {
+	switch (ds) {
+	case BENCH_LIST:
+		bench_cache = KMEM_CACHE(bench_list_node, 0);
+		break;
+	case BENCH_HASH:
+		bench_cache = KMEM_CACHE(bench_hash_node, 0);
+		if (NULL != bench_cache && rhashtable_init(&bench_ht, &bench_ht_params)) {
+			kmem_cache_destroy(bench_cache);
+			bench_cache = NULL;
+		}
+		break;
+	case BENCH_RBTREE:
+		bench_cache = KMEM_CACHE(bench_rb_node, 0);
+		break;
+	case BENCH_XARRAY:
+		return 0;
+	default:
+		/*	Appended to, then sorted once: see bench_one()	*/
+		bench_array = vmalloc(array_size(bench.nr, sizeof(*bench_array)));
+		bench_array_len = 0;
+		return NULL == bench_array ? -ENOMEM : 0;
+	}
+	return NULL == bench_cache ? -ENOMEM : 0;
+}
+
+/*	Whatever the deletes left, and the structure itself	*/
+static void bench_destroy(enum bench_ds ds) {
+	struct bench_list_node *ln, *ltmp;
+	struct bench_rb_node *rn, *rtmp;
+	switch (ds) {
+	case BENCH_LIST:
+		list_for_each_entry_safe(ln, ltmp, &bench_list, list)
+			kmem_cache_free(bench_cache, ln);
+		INIT_LIST_HEAD(&bench_list);
+		break;
+	case BENCH_HASH:
+		rhashtable_free_and_destroy(&bench_ht, bench_hash_free, NULL);
+		break;
+	case BENCH_RBTREE:
+		rbtree_postorder_for_each_entry_safe(rn, rtmp, &bench_rb, node)
+			kmem_cache_free(bench_cache, rn);
+		bench_rb = RB_ROOT;
+		break;
+	case BENCH_XARRAY:
+		xa_destroy(&bench_xa);
+		break;
+	default:
+		vfree(bench_array);
+		bench_array = NULL;
+		break;
+	}
+	kmem_cache_destroy(bench_cache);
+	bench_cache = NULL;
+}
+
+/*
+ *	The per op primitives. A switch, not a table of function pointers:
+ *	it predicts perfectly, an indirect call through a retpoline costs
+ *	more than some of the lookups being timed.
+ */
+static int bench_insert(enum bench_ds ds, u32 key) {
+	struct bench_list_node *ln;
+	struct bench_hash_node *hn;
+	struct bench_rb_node *rn;
+	int ret;
+	switch (ds) {
+	case BENCH_LIST:
+		ln = kmem_cache_alloc(bench_cache, GFP_KERNEL);
+		if (NULL == ln)
+			return -ENOMEM;
+		ln->key = key;
+		list_add_tail(&(ln->list), &bench_list);
+		return 0;
+	case BENCH_HASH:
+		hn = kmem_cache_alloc(bench_cache, GFP_KERNEL);
+		if (NULL == hn)
+			return -ENOMEM;
+		hn->key = key;
+		ret = rhashtable_insert_fast(&bench_ht, &(hn->node), bench_ht_params);
+		if (ret)
+			kmem_cache_free(bench_cache, hn);
+		return ret;
+	case BENCH_RBTREE:
+		rn = kmem_cache_alloc(bench_cache, GFP_KERNEL);
+		if (NULL == rn)
+			return -ENOMEM;
+		rn->key = key;
+		ret = bench_rb_insert(rn);
+		if (ret)
+			kmem_cache_free(bench_cache, rn);
+		return ret;
+	case BENCH_XARRAY:
+		return xa_insert(&bench_xa, key, xa_mk_value(key), GFP_KERNEL);
+	default:
+		bench_array[bench_array_len].key = key;
+		bench_array[bench_array_len].rec = NULL;
+		bench_array_len++;
+		return 0;
+	}
+}
+
+/*	Called under rcu_read_lock(), which the hash table needs	*/
+static bool bench_lookup(enum bench_ds ds, u32 key) {
+	struct bench_list_node *ln;
+	switch (ds) {
+	case BENCH_LIST:
+		list_for_each_entry(ln, &bench_list, list) {
+			if (key == ln->key)
+				return true;
+		}
+		return false;
+	case BENCH_HASH:
+		return NULL != rhashtable_lookup(&bench_ht, &key, bench_ht_params);
+	case BENCH_RBTREE:
+		return NULL != bench_rb_find(key);
+	case BENCH_XARRAY:
+		return NULL != xa_load(&bench_xa, key);
+	default:
+		return bench_array_find(key) >= 0;
+	}
+}
+
+/*
+ *	Nothing looks records up while the benchmark deletes them, so they
+ *	are freed right away, without waiting for a grace period.
+ */
+static bool bench_delete(enum bench_ds ds, u32 key) {
+	struct bench_list_node *ln;
+	struct bench_hash_node *hn;
+	struct bench_rb_node *rn;
+	int i;
+	switch (ds) {
+	case BENCH_LIST:
+		list_for_each_entry(ln, &bench_list, list) {
+			if (key == ln->key) {
+				list_del(&(ln->list));
+				kmem_cache_free(bench_cache, ln);
+				return true;
+			}
+		}
+		return false;
+	case BENCH_HASH:
+		hn = rhashtable_lookup_fast(&bench_ht, &key, bench_ht_params);
+		if (NULL == hn || rhashtable_remove_fast(&bench_ht, &(hn->node), bench_ht_params))
+			return false;
+		kmem_cache_free(bench_cache, hn);
+		return true;
+	case BENCH_RBTREE:
+		rn = bench_rb_find(key);
+		if (NULL == rn)
+			return false;
+		rb_erase(&(rn->node), &bench_rb);
+		kmem_cache_free(bench_cache, rn);
+		return true;
+	case BENCH_XARRAY:
+		return NULL != xa_erase(&bench_xa, key);
+	default:
+		i = bench_array_find(key);
+		if (i < 0)
+			return false;
+		memmove(&bench_array[i], &bench_array[i + 1],
+			(bench_array_len - i - 1) * sizeof(*bench_array));
+		bench_array_len--;
+		return true;
+	}
+}
+
+static bool bench_ordered(enum bench_ds ds) {
+	return BENCH_RBTREE == ds || BENCH_XARRAY == ds || BENCH_ARRAY == ds;
+}
+
+/*	Visit every record in key order, return how many	*/
+static unsigned int bench_scan(enum bench_ds ds) {
+	struct rb_node *node;
+	unsigned long index;
+	unsigned int i, nr = 0;
+	void *entry;
+	u32 sum = 0;
+	switch (ds) {
+	case BENCH_RBTREE:
+		for (node = rb_first(&bench_rb); NULL != node; node = rb_next(node)) {
+			sum += rb_entry(node, struct bench_rb_node, node)->key;
+			if (0 == ++nr % BENCH_CHUNK)
+				cond_resched();
+		}
+		break;
+	case BENCH_XARRAY:
+		xa_for_each(&bench_xa, index, entry) {
+			sum += index;
+			if (0 == ++nr % BENCH_CHUNK)
+				cond_resched();
+		}
+		break;
+	case BENCH_ARRAY:
+		for (i = 0; i < bench_array_len; i++)
+			sum += bench_array[i].key;
+		nr = bench_array_len;
+		break;
+	default:
+		break;
+	}
+	WRITE_ONCE(bench_sink, sum);
+	return nr;
+}
+
+/*
+ *	xarray nodes in use: every leaf met in index order, then its parents
+ *	up to the first one already counted.
+ */
+static unsigned long bench_xa_nodes(void) {
+	XA_STATE(xas, &bench_xa, 0);
+	struct xa_node *last[BITS_PER_LONG / XA_CHUNK_SHIFT + 1] = {};
+	struct xa_node *node;
+	unsigned long nodes = 0;
+	void *entry;
+	rcu_read_lock();
+	xas_for_each(&xas, entry, ULONG_MAX) {
+		for (node = xas.xa_node; !xas_top(node); node = rcu_dereference(node->parent)) {
+			if (last[node->shift / XA_CHUNK_SHIFT] == node)
+				break;
+			last[node->shift / XA_CHUNK_SHIFT] = node;
+			nodes++;
+		}
+	}
+	rcu_read_unlock();
+	return nodes;
+}
+
+/*
+ *	What the index costs per record, on top of a record holding just
+ *	the key: node objects (slab metadata not counted), hash buckets,
+ *	xarray nodes, array slots.
+ */
+static u64 bench_bytes(enum bench_ds ds) {
+	u64 bytes = NULL == bench_cache ? 0 : (u64)kmem_cache_size(bench_cache) * bench.nr;
+	switch (ds) {
+	case BENCH_HASH:
+		rcu_read_lock();
+		bytes += (u64)rht_dereference_rcu(bench_ht.tbl, &bench_ht)->size * sizeof(struct rhash_lock_head *);
+		rcu_read_unlock();
+		break;
+	case BENCH_XARRAY:
+		bytes += (u64)bench_xa_nodes() * sizeof(struct xa_node);
+		break;
+	case BENCH_ARRAY:
+		bytes += (u64)bench.nr * sizeof(*bench_array);
+		break;
+	default:
+		break;
+	}
+	return div_u64(bytes, bench.nr);
+}
+
+/*	How many ops of a phase to time: all of them unless each one is O(n)	*/
+static unsigned int bench_budget(enum bench_ds ds, enum bench_op op, unsigned int ops) {
+	bool linear = BENCH_LIST == ds || (BENCH_ARRAY == ds && BENCH_DELETE == op);
+	if (!linear)
+		return ops;
+	return min(max(BENCH_SLOW_WORK / bench.nr, 1U), ops);
+}
+
+static unsigned int bench_lookup_keys(enum bench_ds ds, const u32 *keys, unsigned int nr) {
+	/*	Sampled phases still draw from the whole key set	*/
+	unsigned int step = bench.lookups / nr, chunk = 1 == step ? BENCH_CHUNK : 1;
+	unsigned int i, found = 0;
+	rcu_read_lock();
+	for (i = 0; i < nr; i++) {
+		if (i && 0 == i % chunk) {
+			rcu_read_unlock();
+			cond_resched();
+			rcu_read_lock();
+		}
+		found += bench_lookup(ds, keys[i * step]);
+	}
+	rcu_read_unlock();
+	return found;
+}
+
+struct bench_clock {
+	u64 ns;
+	cycles_t cycles;
+};
+
+static void bench_clock_start(struct bench_clock *clk) {
+	clk->ns = ktime_get_ns();
+	clk->cycles = get_cycles();
+}
+
+static void bench_clock_stop(struct bench_clock *clk, struct bench_result *res, enum bench_op op, unsigned int ops) {
+	res->cycles[op] = get_cycles() - clk->cycles;
+	res->ns[op] = ktime_get_ns() - clk->ns;
+	res->ops[op] = ops;
+}
+
+static bool bench_wants(enum bench_op op) {
+	return test_bit(op, &bench.ops);
+}
+
+static void bench_check(enum bench_ds ds, enum bench_op op, unsigned int got, unsigned int want) {
+	if (got != want)
+		pr_emerg("VSDBG: bench %s %s: %u records instead of %u\n",
+			 bench_ds_names[ds], bench_op_names[op], got, want);
+}
+
+static int bench_one(enum bench_ds ds) {
+	struct bench_result *res = &bench.res[ds];
+	struct bench_clock clk;
+	unsigned int n = bench.nr, i, nr, step, done;
+	int ret;
+
+	ret = bench_setup(ds);
+	if (ret)
+		return ret;
+	/*	Built every time, timed only when insert is asked for	*/
+	bench_clock_start(&clk);
+	for (i = 0; i < n; i++) {
+		ret = bench_insert(ds, bench_key(i));
+		if (ret)
+			goto out;
+		if (0 == i % BENCH_CHUNK)
+			cond_resched();
+	}
+	/*	A sorted array is built in one go: its insert is append + sort	*/
+	if (BENCH_ARRAY == ds)
+		sort(bench_array, n, sizeof(*bench_array), bench_slot_cmp, NULL);
+	if (bench_wants(BENCH_INSERT))
+		bench_clock_stop(&clk, res, BENCH_INSERT, n);
+	res->bytes = bench_bytes(ds);
+
+	if (bench_wants(BENCH_HIT) && bench.lookups) {
+		nr = bench_budget(ds, BENCH_HIT, bench.lookups);
+		bench_clock_start(&clk);
+		done = bench_lookup_keys(ds, bench.hit_keys, nr);
+		bench_clock_stop(&clk, res, BENCH_HIT, nr);
+		bench_check(ds, BENCH_HIT, done, nr);
+	}
+	if (bench_wants(BENCH_MISS) && bench.lookups) {
+		nr = bench_budget(ds, BENCH_MISS, bench.lookups);
+		bench_clock_start(&clk);
+		done = bench_lookup_keys(ds, bench.miss_keys, nr);
+		bench_clock_stop(&clk, res, BENCH_MISS, nr);
+		bench_check(ds, BENCH_MISS, done, 0);
+	}
+	if (bench_wants(BENCH_SCAN) && bench_ordered(ds)) {
+		bench_clock_start(&clk);
+		done = bench_scan(ds);
+		bench_clock_stop(&clk, res, BENCH_SCAN, n);
+		bench_check(ds, BENCH_SCAN, done, n);
+	}
+	if (bench_wants(BENCH_DELETE)) {
+		nr = bench_budget(ds, BENCH_DELETE, n);
+		step = n / nr;
+		bench_clock_start(&clk);
+		for (i = 0, done = 0; i < nr; i++) {
+			done += bench_delete(ds, bench_key(i * step));
+			if (0 == i % BENCH_CHUNK || 1 != step)
+				cond_resched();
+		}
+		bench_clock_stop(&clk, res, BENCH_DELETE, nr);
+		bench_check(ds, BENCH_DELETE, done, nr);
+	}
+out:
+	bench_destroy(ds);
+	return ret;
+}
+
+/*	Copy the parameters into bench, they may change under a running benchmark	*/
+static int bench_parse(void) {
+	char *ops, *cur, *tok;
+	int ret = 0, i;
+
+	kernel_param_lock(THIS_MODULE);
+	bench.nr = bench_records;
+	bench.lookups = bench_lookups;
+	i = __sysfs_match_string(bench_dist_names, BENCH_DIST_NR, bench_dist);
+	ops = kstrdup(bench_ops, GFP_KERNEL);
+	kernel_param_unlock(THIS_MODULE);
+
+	if (0 == bench.nr || bench.nr > BENCH_MAX_RECORDS || bench.lookups > BENCH_MAX_RECORDS) {
+		pr_emerg("VSDBG: bench_records must be 1 to %u, bench_lookups at most %u\n",
+			 BENCH_MAX_RECORDS, BENCH_MAX_RECORDS);
+		ret = -EINVAL;
+	}
+	if (i < 0) {
+		pr_emerg("VSDBG: bench_dist must be seq, random or zipf\n");
+		ret = -EINVAL;
+	}
+	bench.dist = i < 0 ? BENCH_RANDOM : i;
+	if (NULL == ops)
+		return -ENOMEM;
+	bench.ops = 0;
+	cur = ops;
+	while (NULL != (tok = strsep(&cur, ","))) {
+		tok = strim(tok);
+		if ('\0' == *tok)
+			continue;
+		i = match_string(bench_op_names, BENCH_OP_NR, tok);
+		if (i < 0) {
+			pr_emerg("VSDBG: unknown benchmark operation %s\n", tok);
+			ret = -EINVAL;
+			break;
+		}
+		__set_bit(i, &bench.ops);
+	}
+	kfree(ops);
+	return ret;
+}
+
+/*	Called with bench_lock held	*/
+static int bench_run(void) {
+	u32 seed = 0x9e3779b9;
+	unsigned int i;
+	int ds, ret;
+
+	memset(bench.res, 0, sizeof(bench.res));
+	bench.err = 0;
+	ret = bench_parse();
+	if (ret)
+		goto out;
+	/*	The same lookup keys for every structure, made before any timing	*/
+	bench.hit_keys = vmalloc(array_size(max(bench.lookups, 1U), sizeof(u32)));
+	bench.miss_keys = vmalloc(array_size(max(bench.lookups, 1U), sizeof(u32)));
+	if (NULL == bench.hit_keys || NULL == bench.miss_keys) {
+		ret = -ENOMEM;
+		goto free_keys;
+	}
+	for (i = 0; i < bench.lookups; i++) {
+		bench.hit_keys[i] = bench_key(bench_pick(i, &seed));
+		/*	Ranks from bench.nr up are never inserted	*/
+		bench.miss_keys[i] = bench_key(bench.nr + bench_pick(i, &seed));
+	}
+	for (ds = 0; ds < BENCH_DS_NR; ds++) {
+		ret = bench_one(ds);
+		if (ret) {
+			pr_emerg("VSDBG: bench %s failed: %d\n", bench_ds_names[ds], ret);
+			break;
+		}
+	}
+free_keys:
+	vfree(bench.hit_keys);
+	vfree(bench.miss_keys);
+	bench.hit_keys = bench.miss_keys = NULL;
+out:
+	bench.err = ret;
+	return ret;
+}
+
+static int bench_show(struct seq_file *m, void *v) {
+	struct bench_result *res;
+	u64 want;
+	int ds, op;
+
+	mutex_lock(&bench_lock);
+	if (0 == bench.nr) {
+		seq_puts(m, "not run yet: set bench_records, then write anything to this file\n");
+		goto out;
+	}
+	seq_printf(m, "records %u, keys %s, lookups %u, per op: ns cycles, - = not timed\n",
+		   bench.nr, bench_dist_names[bench.dist], bench.lookups);
+	if (bench.err)
+		seq_printf(m, "stopped early: %d\n", bench.err);
+	seq_printf(m, "%-8s %9s", "", "");
+	for (op = 0; op < BENCH_OP_NR; op++)
+		seq_printf(m, " %20s", bench_op_names[op]);
+	seq_printf(m, "\n%-8s %9s", "struct", "bytes/rec");
+	for (op = 0; op < BENCH_OP_NR; op++)
+		seq_printf(m, " %9s %10s", "ns", "cycles");
+	seq_putc(m, '\n');
+	for (ds = 0; ds < BENCH_DS_NR; ds++) {
+		res = &bench.res[ds];
+		seq_printf(m, "%-8s %9llu", bench_ds_names[ds], res->bytes);
+		for (op = 0; op < BENCH_OP_NR; op++) {
+			if (0 == res->ops[op])
+				seq_printf(m, " %9s %10s", "-", "-");
+			else
+				seq_printf(m, " %9llu %10llu", div64_u64(res->ns[op], res->ops[op]),
+					   div64_u64(res->cycles[op], res->ops[op]));
+		}
+		seq_putc(m, '\n');
+	}
+	/*	Sampled phases	*/
+	for (ds = 0; ds < BENCH_DS_NR; ds++) {
+		res = &bench.res[ds];
+		for (op = 0; op < BENCH_OP_NR; op++) {
+			want = (BENCH_HIT == op || BENCH_MISS == op) ? bench.lookups : bench.nr;
+			if (res->ops[op] && res->ops[op] < want)
+				seq_printf(m, "%s %s: over %llu ops\n", bench_ds_names[ds], bench_op_names[op], res->ops[op]);
+		}
+	}
+out:
+	mutex_unlock(&bench_lock);
+	return 0;
+}
+
+static int bench_open(struct inode *inode, struct file *file) {
+	return single_open(file, bench_show, NULL);
+}
+
+/*	Any write runs the suite again with the current parameters	*/
+static ssize_t bench_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+	int ret;
+	mutex_lock(&bench_lock);
+	ret = bench_run();
+	mutex_unlock(&bench_lock);
+	return ret ? ret : count;
+}
+
+static const struct file_operations bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= bench_open,
+	.read		= seq_read,
+	.write		= bench_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int init_kernel_ds(void)
 {
+	int ret;
+	emp_cache = KMEM_CACHE(emp_record, SLAB_HWCACHE_ALIGN);
+	if (NULL == emp_cache)
+		return -ENOMEM;
 	PS("============================================================================");
 	PS("-------------------------------------------------------")
 	PS("init: Linked lists in kernel");
 	PS("-------------------------------------------------------")
-	init_records();
+	ret = init_records();
+	if (ret)
+		goto free_cache;
 	print_records();
 	PS("-------------------------------------------------------")
 	PS("init: Queues in kernel");
@@ -362,11 +1287,17 @@ static int init_kernel_ds(void)
 	PS("-------------------------------------------------------")
 	PS("init: Hash table in kernel");
 	PS("-------------------------------------------------------")
-	init_hash_tbl();
+	ret = init_hash_tbl();
+	if (ret) {
+		delete_q();
+		goto free_cache;
+	}
 	print_hash_tbl();
 	look_up_hash_tbl(67);
 	look_up_hash_tbl(68);
 	look_up_hash_tbl(23);
+	if (hash_bench_max)
+		bench_hash_tbl(hash_bench_max);
 	PS("-------------------------------------------------------")
 	PS("init: Red Black trees in kernel");
 	PS("-------------------------------------------------------")
@@ -375,24 +1306,67 @@ static int init_kernel_ds(void)
 	search_rb_tree(&root, 10);
 	search_rb_tree(&root, 36);
 	search_rb_tree(&root, 2);
+	if (nr_records) {
+		PS("-------------------------------------------------------")
+		PS("init: Record set");
+		PS("-------------------------------------------------------")
+		ret = load_records(nr_records);
+		if (ret) {
+			pr_emerg("VSDBG: loading %u records failed: %d\n", nr_records, ret);
+			goto free_all;
+		}
+	}
+	/*	Nothing below can fail the load	*/
+	bench_dir = debugfs_create_dir("kernel_ds", NULL);
+	debugfs_create_file("bench", 0644, bench_dir, NULL, &bench_fops);
+	if (bench_records) {
+		PS("-------------------------------------------------------")
+		PS("init: Benchmark suite");
+		PS("-------------------------------------------------------")
+		mutex_lock(&bench_lock);
+		bench_run();
+		mutex_unlock(&bench_lock);
+	}
 	return 0;
+
+free_all:
+	delete_q();
+	delete_records();
+	rhashtable_destroy(&hash_tbl);
+	kmem_cache_destroy(emp_cache);
+	return ret;
+free_cache:
+	/*	Nothing is hashed or in the tree yet, the list is all there is	*/
+	free_records();
+	kmem_cache_destroy(emp_cache);
+	return ret;
 }
 
 /*
- *	Fix me: Revisit exit function for exiting the right way.
+ *	Records first: they are unlinked from the hash table, so it has to
+ *	still be there. kmem_cache_destroy() complains about any record left.
  */
 static void exit_kernel_ds(void)
 {
+	/*	Waits for a benchmark run from a write to finish	*/
+	debugfs_remove_recursive(bench_dir);
 	PS("-------------------------------------------------------")
 	PS("exit: Linked lists in kernel");
 	PS("-------------------------------------------------------")
-	/*	fix me: Not working delete_records	*/
-	//delete_records();
+	delete_records();
 	PS("-------------------------------------------------------")
 	PS("exit: Queues in kernel");
 	PS("-------------------------------------------------------")
 	delete_q();
+	PS("-------------------------------------------------------")
+	PS("exit: Hash table in kernel");
+	PS("-------------------------------------------------------")
+	rhashtable_destroy(&hash_tbl);
+	kmem_cache_destroy(emp_cache);
 }
 
 module_init(init_kernel_ds);
 module_exit(exit_kernel_ds);
+
+/*	rhashtable is GPL only	*/
+MODULE_LICENSE("GPL");
@@ -1,5 +1,7 @@
-static void init_records(void);
+static int init_records(void);
 static void print_records(void);
+static int load_records(unsigned int nr);
+static unsigned int free_records(void);
 static void delete_records(void);
 
 static void init_q(void);